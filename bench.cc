@@ -0,0 +1,254 @@
+// Microbenchmarks for ponymix's hot paths, run against the simulated
+// server (see pulse_sim.h). Each reports the time and the number of heap
+// allocations per operation. The round_trips ones instead run a whole
+// command and report the requests it makes and the round trips it waits
+// out, connecting aside. Only allocations made through operator new
+// are counted: those libpulse makes with malloc, e.g. for proplists, are
+// not, so the counts are a floor rather than the whole cost.
+//
+//   usage: ponymix-bench [FILTER]
+//
+// Only benchmarks whose names contain FILTER are run.
+
+#include "ponymix.h"
+#include "pulse.h"
+#include "pulse_sim.h"
+
+// C
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// C++
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+size_t allocations = 0;
+
+const uint64_t kMinDurationNs = 200 * 1000 * 1000;
+
+FILE* out;
+const char* filter;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Keep the compiler from optimizing away a result nobody looks at.
+template<typename T>
+void keep(const T& value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+template<typename Fn>
+void run(const std::string& name, Fn fn) {
+  if (filter != nullptr && name.find(filter) == std::string::npos) return;
+
+  // Grow the iteration count until a run takes long enough to time.
+  for (uint64_t iterations = 1;; ) {
+    const size_t allocs = allocations;
+    const uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) fn(i);
+    const uint64_t elapsed = now_ns() - start;
+
+    if (elapsed >= kMinDurationNs) {
+      fprintf(out, "%-40s %12llu %12.1f ns/op %10.2f allocs/op\n",
+              name.c_str(), static_cast<unsigned long long>(iterations),
+              static_cast<double>(elapsed) / iterations,
+              static_cast<double>(allocations - allocs) / iterations);
+      fflush(out);
+      return;
+    }
+    iterations *= elapsed < kMinDurationNs / 10 ? 10 : 2;
+  }
+}
+
+void bench_commands() {
+  run("string_to_command/exact", [](uint64_t) {
+    keep(string_to_command("set-volume"));
+  });
+  run("string_to_command/prefix", [](uint64_t) {
+    keep(string_to_command("get-v"));
+  });
+}
+
+void bench_fuzzy() {
+  for (unsigned count : { 100, 10000, 100000 }) {
+    SimConfig config;
+    config.sinks = 4;
+    config.sink_inputs = count;
+    SimConfigure(config);
+
+    PulseClient ponymix("ponymix-bench");
+    ponymix.GetSinkInputs();
+
+    const std::string rare = "Track " + std::to_string(count - 1);
+    const std::string n = std::to_string(count);
+    run("find_fuzzy/" + n + "/rare", [&](uint64_t) {
+      keep(ponymix.GetDevice(rare, DeviceType::SINK_INPUT));
+    });
+    // Matches an eighth of them, and warns that it's ambiguous.
+    run("find_fuzzy/" + n + "/common", [&](uint64_t) {
+      keep(ponymix.GetDevice("spotify", DeviceType::SINK_INPUT));
+    });
+  }
+}
+
+void bench_device() {
+  pa_proplist* proplist = pa_proplist_new();
+  pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, "mpv");
+  pa_proplist_sets(proplist, PA_PROP_APPLICATION_PROCESS_BINARY, "mpv");
+  pa_proplist_sets(proplist, PA_PROP_MEDIA_NAME, "Some Artist - Some Track.flac");
+
+  pa_sink_input_info info;
+  memset(&info, 0, sizeof(info));
+  info.index = 42;
+  info.name = "playback";
+  info.sink = 0;
+  pa_channel_map_init_stereo(&info.channel_map);
+  pa_cvolume_set(&info.volume, 2, PA_VOLUME_NORM / 2);
+  info.proplist = proplist;
+
+  run("Device/sink_input", [&](uint64_t) {
+    Device device(&info);
+    keep(device);
+  });
+
+  pa_proplist_free(proplist);
+}
+
+void bench_volume() {
+  pa_cvolume cvol;
+  pa_cvolume_set(&cvol, 2, PA_VOLUME_NORM);
+
+  run("value_to_cvol", [&](uint64_t i) {
+    keep(value_to_cvol(i % 151, &cvol));
+  });
+  run("volume_as_percent", [&](uint64_t i) {
+    cvol.values[0] = i % PA_VOLUME_NORM;
+    keep(volume_as_percent(&cvol));
+  });
+}
+
+void bench_print() {
+  SimConfigure(SimConfig());
+  PulseClient ponymix("ponymix-bench");
+  const Device& device = *ponymix.GetDevice(0, DeviceType::SINK);
+  const Card& card = ponymix.GetCards().front();
+
+  for (bool brief : { false, true }) {
+    char name[] = "ponymix-bench";
+    char flag[] = "--short";
+    char* argv[] = { name, brief ? flag : nullptr, nullptr };
+    ParseCommandOptions(brief ? 2 : 1, argv);
+
+    const std::string suffix = brief ? "/short" : "/long";
+    run("Print/device" + suffix, [&](uint64_t) { Print(device); });
+    run("Print/card" + suffix, [&](uint64_t) { Print(card); });
+  }
+
+  // Reserved once, like a listing's buffer, and emptied between records.
+  JsonWriter json(512);
+  run("Write/device", [&](uint64_t) {
+    Write(json, device);
+    keep(json.Buffer());
+    json.Clear();
+  });
+  run("Write/card", [&](uint64_t) {
+    Write(json, card);
+    keep(json.Buffer());
+    json.Clear();
+  });
+}
+
+// Run a command line, as ponymix would with no daemon running, against a
+// fresh server, and report what it asked of the server.
+void count(const std::vector<const char*>& words) {
+  std::string name = "round_trips/";
+  for (const char* word : words) name += (name.back() == '/' ? "" : " ") + std::string(word);
+  if (filter != nullptr && name.find(filter) == std::string::npos) return;
+
+  std::vector<std::string> storage{ "ponymix" };
+  storage.insert(storage.end(), words.begin(), words.end());
+  std::vector<char*> argv;
+  for (std::string& word : storage) argv.push_back(&word[0]);
+  argv.push_back(nullptr);
+
+  SimConfigure(SimConfig());
+  {
+    PulseClient ponymix("ponymix-bench");
+    RunCommandLine(ponymix, argv.size() - 1, argv.data());
+  }
+
+  const SimStats stats = SimGetStats();
+  fprintf(out, "%-40s %12lu requests %8lu round trips\n", name.c_str(),
+          stats.requests, stats.round_trips);
+  fflush(out);
+}
+
+void bench_round_trips() {
+  const std::vector<std::vector<const char*>> commands = {
+    { "get-volume" },
+    { "is-muted" },
+    { "set-volume", "50" },
+    { "increase", "5" },
+    { "toggle" },
+    { "defaults" },
+    { "list" },
+    { "--sink", "list" },
+    { "list-cards" },
+    { "get-profile" },
+    { "--sink-input", "-d", "0", "move", "sim_output.1" },
+    { "-d", "sim_output.1", "set-default" },
+  };
+  for (const auto& words : commands) count(words);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+// Not inlined, or GCC takes our own new and delete for a mismatched pair.
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+int main(int argc, char* argv[]) {
+  filter = argc > 1 ? argv[1] : nullptr;
+
+  // What ponymix prints, warnings included, goes nowhere, but still goes
+  // through stdio.
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  if (out == nullptr || freopen("/dev/null", "w", stdout) == nullptr ||
+      freopen("/dev/null", "w", stderr) == nullptr) {
+    err(1, "failed to redirect output");
+  }
+
+  bench_commands();
+  bench_fuzzy();
+  bench_device();
+  bench_volume();
+  bench_print();
+  bench_round_trips();
+
+  return 0;
+}
+
+// vim: set et ts=2 sw=2:
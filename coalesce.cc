@@ -0,0 +1,93 @@
+// Self
+#include "coalesce.h"
+
+#include "runtime.h"
+
+// C
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+Coalescer::Coalescer(const std::string& key) {
+  const std::string path = RuntimePath(key, "adjust");
+  if (path.empty()) return;
+
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+Coalescer::~Coalescer() {
+  // Don't leave anything behind for a leader which isn't coming back.
+  if (leading_ && lock()) {
+    State state = {};
+    if (pread(fd_, &state, sizeof(state), 0) != sizeof(state)) state = {};
+    state.leader = 0;
+    unlock(state);
+  }
+
+  if (fd_ >= 0) close(fd_);
+}
+
+bool Coalescer::lock() {
+  while (flock(fd_, LOCK_EX) < 0) {
+    if (errno != EINTR) return false;
+  }
+  return true;
+}
+
+bool Coalescer::unlock(const State& state) {
+  const bool written = pwrite(fd_, &state, sizeof(state), 0) == sizeof(state);
+  flock(fd_, LOCK_UN);
+  return written;
+}
+
+bool Coalescer::Offer(long delta) {
+  if (fd_ < 0 || !lock()) return false;
+
+  // A fresh file reads as nothing pending and no leader.
+  State state = {};
+  if (pread(fd_, &state, sizeof(state), 0) != sizeof(state)) state = {};
+
+  if (ProcessAlive(state.leader) && state.leader != getpid()) {
+    // If our adjustment can't be left for the leader, apply it ourselves.
+    state.delta += delta;
+    return unlock(state);
+  }
+
+  // Anything a leader which died left behind stays pending, to be picked
+  // up by our first Take.
+  leading_ = true;
+  state.leader = getpid();
+  unlock(state);
+  return false;
+}
+
+bool Coalescer::Take(long window, long* delta) {
+  if (!leading_) return false;
+
+  struct timespec ts = { window / 1000, (window % 1000) * 1000000 };
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+
+  if (!lock()) return false;
+
+  // Whatever can't be read counts as nothing pending. Whatever was read
+  // but can't be cleared is left for a later leader rather than applied
+  // twice.
+  State state = {};
+  if (pread(fd_, &state, sizeof(state), 0) != sizeof(state)) state = {};
+  *delta = state.delta;
+  state.delta = 0;
+  if (*delta == 0) {
+    state.leader = 0;
+    leading_ = false;
+  }
+  if (!unlock(state)) {
+    *delta = 0;
+    leading_ = false;
+  }
+
+  return leading_;
+}
+
+// vim: set et ts=2 sw=2:
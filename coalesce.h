@@ -0,0 +1,48 @@
+#pragma once
+
+// C
+#include <sys/types.h>
+
+// C++
+#include <string>
+
+// Merges relative adjustments made by concurrent invocations. The first
+// invocation to arrive applies its own adjustment and then, one window at a
+// time, whatever the others have left for it, until a window passes with
+// nothing new. The others just leave their adjustment and exit.
+//
+// The state lives in a file in the runtime directory, guarded by a lock.
+// Without a runtime directory, every invocation applies its own adjustment.
+class Coalescer {
+ public:
+  // Adjustments are only merged with others made with the same key.
+  explicit Coalescer(const std::string& key);
+  ~Coalescer();
+
+  // Leave an adjustment for the invocation applying them. Returns false if
+  // there is none, in which case the caller should apply it itself, then
+  // call Take until it returns false.
+  bool Offer(long delta);
+
+  // Wait window milliseconds and collect the adjustments which arrived in
+  // the meantime. Returns false, and stops applying adjustments for others,
+  // once nothing arrives.
+  bool Take(long window, long* delta);
+
+ private:
+  struct State {
+    pid_t leader;
+    long delta;
+  };
+
+  bool lock();
+
+  // Write the state back and release the lock. Returns false if the state
+  // couldn't be written.
+  bool unlock(const State& state);
+
+  int fd_ = -1;
+  bool leading_ = false;
+};
+
+// vim: set et ts=2 sw=2:
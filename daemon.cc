@@ -0,0 +1,475 @@
+// Self
+#include "daemon.h"
+
+#include "runtime.h"
+#include "snapshot.h"
+
+// C
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// C++
+#include <map>
+#include <memory>
+#include <vector>
+
+// A client connects and sends, in a single message carrying its stdin,
+// stdout and stderr, the size of the payload followed by the payload: its
+// working directory and each of its arguments, all NUL terminated. Once
+// the command has run, the daemon replies with its exit status.
+
+namespace {
+
+const size_t kMaxRequestSize = 64 * 1024;
+
+// How long a client has to get its whole request across.
+const pa_usec_t kRequestTimeoutUsec = PA_USEC_PER_SEC;
+
+struct Server;
+
+// A connection whose request is still arriving. It's read as and when the
+// socket is readable, so a slow client holds up nobody else.
+struct Incoming {
+  Server* server;
+  int fd;
+  pa_io_event* readable;
+  pa_time_event* timeout;
+
+  // The client's stdin, stdout and stderr, which come with the first byte.
+  int fds[3];
+  uint32_t size;
+  size_t size_read;
+  std::string payload;
+  size_t payload_read;
+};
+
+struct Request {
+  int fd;
+  pa_io_event* hangup;
+};
+
+struct Server {
+  PulseClient* ponymix;
+  CommandLineHandler handler;
+  pa_mainloop_api* api;
+  int fd;
+  std::map<int, std::unique_ptr<Incoming>> incoming;
+  std::map<pid_t, Request> requests;
+};
+
+int connect_socket(const std::string& path) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) return -1;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+bool send_all(int fd, const char* buf, size_t size) {
+  while (size > 0) {
+    ssize_t r = send(fd, buf, size, MSG_NOSIGNAL);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    buf += r;
+    size -= r;
+  }
+  return true;
+}
+
+void close_fds(int fds[3]) {
+  for (int i = 0; i < 3; i++) {
+    if (fds[i] >= 0) close(fds[i]);
+    fds[i] = -1;
+  }
+}
+
+// Take the client's descriptors from the message which brought the first
+// byte. Any passed along with anything amiss are closed, not leaked.
+bool take_fds(struct msghdr* msg, int fds[3]) {
+  bool ok = !(msg->msg_flags & MSG_CTRUNC);
+  size_t count = 0;
+
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      ok = false;
+      continue;
+    }
+
+    const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < n; i++) {
+      int received;
+      memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (count < 3) {
+        fds[count] = received;
+      } else {
+        close(received);
+      }
+      count++;
+    }
+  }
+
+  if (ok && count == 3) return true;
+
+  close_fds(fds);
+  return false;
+}
+
+// Read whatever of a request has arrived. Returns false if the client
+// hung up or sent something which isn't a request.
+bool read_request(Incoming* in) {
+  while (in->size_read < sizeof(in->size)) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {
+      reinterpret_cast<char*>(&in->size) + in->size_read,
+      sizeof(in->size) - in->size_read,
+    };
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t r = recvmsg(in->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 && errno == EAGAIN) return true;
+    if (r <= 0) return false;
+
+    if (in->size_read == 0) {
+      if (!take_fds(&msg, in->fds)) return false;
+    } else if (msg.msg_controllen > 0) {
+      int stray[3] = { -1, -1, -1 };
+      take_fds(&msg, stray);
+      close_fds(stray);
+      return false;
+    }
+    in->size_read += r;
+
+    if (in->size_read == sizeof(in->size)) {
+      if (in->size > kMaxRequestSize) return false;
+      in->payload.resize(in->size);
+    }
+  }
+
+  while (in->payload_read < in->size) {
+    ssize_t r = recv(in->fd, &in->payload[in->payload_read],
+                     in->size - in->payload_read, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 && errno == EAGAIN) return true;
+    if (r <= 0) return false;
+    in->payload_read += r;
+  }
+
+  return true;
+}
+
+bool request_complete(const Incoming& in) {
+  return in.size_read == sizeof(in.size) && in.payload_read == in.size;
+}
+
+// Stop watching a connection whose request was read or given up on.
+std::unique_ptr<Incoming> finish_incoming(Incoming* in) {
+  pa_mainloop_api* api = in->server->api;
+  api->io_free(in->readable);
+  api->time_free(in->timeout);
+
+  auto& incoming = in->server->incoming;
+  auto it = incoming.find(in->fd);
+  std::unique_ptr<Incoming> owned = std::move(it->second);
+  incoming.erase(it);
+  return owned;
+}
+
+void drop_incoming(Incoming* in) {
+  std::unique_ptr<Incoming> owned = finish_incoming(in);
+  close_fds(owned->fds);
+  close(owned->fd);
+}
+
+void run_request(Server* server, int fds[3], const std::string& payload) {
+  for (int sig : { SIGCHLD, SIGINT, SIGTERM }) signal(sig, SIG_DFL);
+  close(server->fd);
+
+  // Other clients' requests are none of ours, and holding their sockets
+  // would keep them from seeing the daemon give up on them.
+  for (auto& incoming : server->incoming) {
+    close_fds(incoming.second->fds);
+    close(incoming.second->fd);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+    if (fds[i] > 2) close(fds[i]);
+  }
+
+  std::vector<char*> argv;
+  for (size_t i = 0; i < payload.size(); i += strlen(&payload[i]) + 1) {
+    argv.push_back(const_cast<char*>(&payload[i]));
+  }
+  if (argv.size() < 2) exit(EXIT_FAILURE);
+
+  if (chdir(argv[0]) < 0) warn("failed to change directory to %s", argv[0]);
+  argv.erase(argv.begin());
+  argv.push_back(nullptr);
+
+  server->ponymix->DropConnection();
+  exit(server->handler(*server->ponymix, argv.size() - 1, argv.data()));
+}
+
+void hangup_cb(pa_mainloop_api* api, pa_io_event* event, int fd,
+               pa_io_event_flags_t, void* raw) {
+  auto server = static_cast<Server*>(raw);
+
+  // Clients never send anything after their request, so this means the
+  // client went away. Nobody is left to see what the command does.
+  for (auto& request : server->requests) {
+    if (request.second.fd == fd) {
+      kill(request.first, SIGTERM);
+      request.second.hangup = nullptr;
+      break;
+    }
+  }
+
+  api->io_free(event);
+}
+
+void start_request(Server* server, int conn, int fds[3],
+                   const std::string& payload) {
+  pa_mainloop_api* api = server->api;
+
+  // Whatever the child builds would be thrown away with it.
+  server->ponymix->BuildSearchIndex();
+
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(conn);
+    run_request(server, fds, payload);
+  }
+
+  close_fds(fds);
+
+  if (pid < 0) {
+    warn("failed to fork");
+    close(conn);
+    return;
+  }
+
+  // The exit status is all that's left to send, and it fits in any
+  // socket buffer, but send it the plain way all the same.
+  fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) & ~O_NONBLOCK);
+  server->requests[pid] = {
+    conn,
+    api->io_new(api, conn, PA_IO_EVENT_INPUT, hangup_cb, server),
+  };
+}
+
+void incoming_cb(pa_mainloop_api*, pa_io_event*, int,
+                 pa_io_event_flags_t, void* raw) {
+  auto in = static_cast<Incoming*>(raw);
+
+  if (!read_request(in)) {
+    drop_incoming(in);
+    return;
+  }
+  if (!request_complete(*in)) return;
+
+  std::unique_ptr<Incoming> done = finish_incoming(in);
+  start_request(done->server, done->fd, done->fds, done->payload);
+}
+
+// Don't let a client which never finishes its request hold on to a
+// connection.
+void incoming_timeout_cb(pa_mainloop_api*, pa_time_event*,
+                         const struct timeval*, void* raw) {
+  drop_incoming(static_cast<Incoming*>(raw));
+}
+
+void accept_cb(pa_mainloop_api* api, pa_io_event*, int fd,
+               pa_io_event_flags_t, void* raw) {
+  auto server = static_cast<Server*>(raw);
+
+  int conn = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (conn < 0) return;
+
+  std::unique_ptr<Incoming> in(new Incoming{
+    server, conn, nullptr, nullptr, { -1, -1, -1 }, 0, 0, "", 0,
+  });
+
+  struct timeval tv;
+  in->readable = api->io_new(api, conn, PA_IO_EVENT_INPUT, incoming_cb,
+                             in.get());
+  in->timeout = api->time_new(
+      api, pa_timeval_rtstore(&tv, pa_rtclock_now() + kRequestTimeoutUsec, true),
+      incoming_timeout_cb, in.get());
+  server->incoming[conn] = std::move(in);
+}
+
+void sigchld_cb(pa_mainloop_api* api, pa_signal_event*, int, void* raw) {
+  auto server = static_cast<Server*>(raw);
+
+  int wstatus;
+  pid_t pid;
+  while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+    auto request = server->requests.find(pid);
+    if (request == server->requests.end()) continue;
+
+    int32_t status = WIFEXITED(wstatus) ?
+        WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    send_all(request->second.fd, reinterpret_cast<char*>(&status),
+             sizeof(status));
+
+    if (request->second.hangup) api->io_free(request->second.hangup);
+    close(request->second.fd);
+    server->requests.erase(request);
+  }
+}
+
+void quit_cb(pa_mainloop_api* api, pa_signal_event*, int, void*) {
+  api->quit(api, 0);
+}
+
+}  // namespace
+
+std::string DaemonSocketPath() {
+  return RuntimePath("ponymix.socket");
+}
+
+int RunDaemon(PulseClient& ponymix, CommandLineHandler handler) {
+  std::string path = DaemonSocketPath();
+  if (path.empty()) errx(1, "error: XDG_RUNTIME_DIR is not set");
+
+  int fd = connect_socket(path);
+  if (fd >= 0) errx(1, "error: daemon is already listening on %s", path.c_str());
+
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errx(1, "error: socket path is too long: %s", path.c_str());
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  // Anything still there is left over from a daemon which died.
+  unlink(path.c_str());
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    err(1, "error: failed to listen on %s", path.c_str());
+  }
+
+  ponymix.Subscribe();
+  ponymix.Populate();
+
+  // Queries which only need what's known here can be answered from the
+  // snapshot, without even connecting to us.
+  SnapshotWriter snapshot;
+  if (!snapshot.Publish(ponymix.SaveSnapshot())) {
+    warn("failed to publish snapshot to %s", SnapshotPath().c_str());
+  }
+  ponymix.SetChangeCallback([&ponymix, &snapshot] {
+    snapshot.Publish(ponymix.SaveSnapshot());
+  }, 0);
+
+  Server server{ &ponymix, handler, ponymix.MainloopApi(), fd, {}, {} };
+  pa_mainloop_api* api = server.api;
+
+  pa_signal_init(api);
+  pa_signal_new(SIGCHLD, sigchld_cb, &server);
+  pa_signal_new(SIGINT, quit_cb, nullptr);
+  pa_signal_new(SIGTERM, quit_cb, nullptr);
+  pa_io_event* listener =
+      api->io_new(api, fd, PA_IO_EVENT_INPUT, accept_cb, &server);
+
+  int r = ponymix.Run();
+
+  api->io_free(listener);
+  unlink(path.c_str());
+  close(fd);
+
+  while (!server.incoming.empty()) {
+    drop_incoming(server.incoming.begin()->second.get());
+  }
+  for (auto& request : server.requests) {
+    kill(request.first, SIGTERM);
+    if (request.second.hangup) api->io_free(request.second.hangup);
+    close(request.second.fd);
+  }
+  pa_signal_done();
+
+  return r;
+}
+
+bool ForwardToDaemon(int argc, char* argv[], int* status) {
+  std::string path = DaemonSocketPath();
+  if (path.empty()) return false;
+
+  int fd = connect_socket(path);
+  if (fd < 0) return false;
+
+  std::string payload;
+  char* cwd = getcwd(nullptr, 0);
+  payload.append(cwd ? cwd : "/").push_back('\0');
+  free(cwd);
+  for (int i = 0; i < argc; i++) payload.append(argv[i]).push_back('\0');
+
+  uint32_t size = payload.size();
+  int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = { &size, sizeof(size) };
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // Once the request is out, the command may already be running, so
+  // falling back to running it ourselves is no longer an option.
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(size)) {
+    close(fd);
+    return false;
+  }
+
+  int32_t result;
+  if (!send_all(fd, payload.data(), payload.size()) ||
+      recv(fd, &result, sizeof(result), MSG_WAITALL) != sizeof(result)) {
+    warnx("error: lost connection to ponymix daemon");
+    result = EXIT_FAILURE;
+  }
+  close(fd);
+
+  *status = result;
+  return true;
+}
+
+// vim: set et ts=2 sw=2:
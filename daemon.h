@@ -0,0 +1,25 @@
+#pragma once
+
+#include "pulse.h"
+
+// C++
+#include <string>
+
+// Runs a full command line, including argv[0], on behalf of a client.
+typedef int (*CommandLineHandler)(PulseClient& ponymix, int argc, char* argv[]);
+
+// The socket the daemon listens on, or an empty string if there's no
+// runtime directory to put it in.
+std::string DaemonSocketPath();
+
+// Serve command lines from clients until terminated. Each command line is
+// run by the handler in a forked child, against the devices and cards the
+// daemon keeps current, with the client's stdin, stdout and stderr.
+int RunDaemon(PulseClient& ponymix, CommandLineHandler handler);
+
+// Have a running daemon run a command line on our behalf, storing its exit
+// status. Returns false, without running anything, if no daemon is
+// listening.
+bool ForwardToDaemon(int argc, char* argv[], int* status);
+
+// vim: set et ts=2 sw=2:
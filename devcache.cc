@@ -0,0 +1,53 @@
+// Self
+#include "devcache.h"
+
+#include "runtime.h"
+
+// C
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Far more than any one device takes. Anything bigger isn't ours.
+const off_t kMaxEntrySize = 64 * 1024;
+
+}  // namespace
+
+DeviceCache::DeviceCache(const std::string& key)
+    : path_(RuntimePath(key, "device")) {}
+
+bool DeviceCache::Load(std::string* entry) const {
+  if (path_.empty()) return false;
+
+  int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  struct stat st;
+  bool loaded = false;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= kMaxEntrySize) {
+    entry->resize(st.st_size);
+    loaded = pread(fd, &(*entry)[0], st.st_size, 0) == st.st_size;
+  }
+
+  close(fd);
+  return loaded;
+}
+
+void DeviceCache::Store(const std::string& entry) const {
+  if (path_.empty()) return;
+
+  // Readers see the old entry or the new one, never a mix.
+  std::string temp = path_ + "." + std::to_string(getpid());
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) return;
+
+  bool written = write(fd, entry.data(), entry.size()) ==
+      static_cast<ssize_t>(entry.size());
+  close(fd);
+
+  if (!written || rename(temp.c_str(), path_.c_str()) < 0) unlink(temp.c_str());
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,27 @@
+#pragma once
+
+// C++
+#include <string>
+
+// Remembers, from one invocation to the next, what a device selector such
+// as a sink's name resolved to, so that the device can be changed without
+// being looked up first. Each selector's entry is a file in the runtime
+// directory, replaced whole on every store. Without a runtime directory,
+// nothing is remembered.
+class DeviceCache {
+ public:
+  // Entries are kept apart by key.
+  explicit DeviceCache(const std::string& key);
+
+  // Read the entry, returning false if there's none.
+  bool Load(std::string* entry) const;
+
+  // Replace the entry. Failures are ignored: all that's lost is a shortcut
+  // next time.
+  void Store(const std::string& entry) const;
+
+ private:
+  std::string path_;
+};
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,152 @@
+// Self
+#include "json.h"
+
+// C
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace {
+
+// The length of the valid UTF-8 sequence of more than one byte starting at
+// p, or 0 if there's none. Overlong forms, surrogates and code points past
+// U+10FFFF are invalid.
+size_t utf8_sequence(const unsigned char* p) {
+  auto continues = [p](int i, unsigned char min, unsigned char max) {
+    return p[i] >= min && p[i] <= max;
+  };
+
+  if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+    return continues(1, 0x80, 0xbf) ? 2 : 0;
+  }
+  if (p[0] >= 0xe0 && p[0] <= 0xef) {
+    const unsigned char min = p[0] == 0xe0 ? 0xa0 : 0x80;
+    const unsigned char max = p[0] == 0xed ? 0x9f : 0xbf;
+    return continues(1, min, max) && continues(2, 0x80, 0xbf) ? 3 : 0;
+  }
+  if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+    const unsigned char min = p[0] == 0xf0 ? 0x90 : 0x80;
+    const unsigned char max = p[0] == 0xf4 ? 0x8f : 0xbf;
+    return continues(1, min, max) && continues(2, 0x80, 0xbf) &&
+           continues(3, 0x80, 0xbf) ? 4 : 0;
+  }
+  return 0;
+}
+
+}  // namespace
+
+void AppendJsonString(const char* str, std::string* out) {
+  *out += '"';
+
+  // Runs of characters which need no escaping are copied whole. A NUL
+  // stops the checks on continuation bytes before they run off the end.
+  const char* run = str;
+  const char* p = str;
+  while (*p != '\0') {
+    const unsigned char c = *p;
+    if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+      p++;
+      continue;
+    }
+
+    if (c >= 0x80) {
+      const size_t length =
+          utf8_sequence(reinterpret_cast<const unsigned char*>(p));
+      if (length != 0) {
+        p += length;
+        continue;
+      }
+    }
+
+    out->append(run, p - run);
+    if (c == '"' || c == '\\') {
+      *out += '\\';
+      *out += c;
+    } else if (c < 0x20) {
+      char escape[8];
+      out->append(escape, snprintf(escape, sizeof(escape), "\\u%04x", c));
+    } else {
+      *out += "\xef\xbf\xbd";  // U+FFFD
+    }
+    run = ++p;
+  }
+  out->append(run);
+
+  *out += '"';
+}
+
+JsonWriter& JsonWriter::Key(const char* key) {
+  separate();
+  AppendJsonString(key, &buffer_);
+  buffer_ += ':';
+  separate_ = false;
+  return *this;
+}
+
+void JsonWriter::String(const char* str) {
+  separate();
+  AppendJsonString(str, &buffer_);
+}
+
+void JsonWriter::Int(long value) {
+  separate();
+  char digits[24];
+  buffer_.append(digits, snprintf(digits, sizeof(digits), "%ld", value));
+}
+
+void JsonWriter::Uint(unsigned long value) {
+  separate();
+  char digits[24];
+  buffer_.append(digits, snprintf(digits, sizeof(digits), "%lu", value));
+}
+
+void JsonWriter::Bool(bool value) {
+  separate();
+  buffer_ += value ? "true" : "false";
+}
+
+void JsonWriter::Null() {
+  separate();
+  buffer_ += "null";
+}
+
+void JsonWriter::Newline() {
+  buffer_ += '\n';
+  separate_ = false;
+}
+
+bool JsonWriter::Flush(int fd) {
+  const char* data = buffer_.data();
+  size_t left = buffer_.size();
+  while (left > 0) {
+    const ssize_t written = write(fd, data, left);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      Clear();
+      return false;
+    }
+    data += written;
+    left -= written;
+  }
+
+  Clear();
+  return true;
+}
+
+void JsonWriter::open(char bracket) {
+  separate();
+  buffer_ += bracket;
+  separate_ = false;
+}
+
+void JsonWriter::close(char bracket) {
+  buffer_ += bracket;
+  separate_ = true;
+}
+
+void JsonWriter::separate() {
+  if (separate_) buffer_ += ',';
+  separate_ = true;
+}
+
+// vim: set et ts=2 sw=2:
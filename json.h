@@ -0,0 +1,66 @@
+#pragma once
+
+// C
+#include <stddef.h>
+
+// C++
+#include <string>
+
+// Append str to out as a quoted JSON string. Bytes which aren't part of
+// valid UTF-8, which JSON text must be, are each replaced with U+FFFD.
+void AppendJsonString(const char* str, std::string* out);
+
+// Builds JSON text in one buffer, reserved up front, to be written out with
+// a single write rather than a printf per field. Commas go between members
+// and elements as they're added; nothing else checks that what's built is
+// well formed.
+class JsonWriter {
+ public:
+  explicit JsonWriter(size_t reserve = 0) { buffer_.reserve(reserve); }
+
+  JsonWriter(const JsonWriter&) = delete;
+  JsonWriter& operator=(const JsonWriter&) = delete;
+
+  void BeginObject() { open('{'); }
+  void EndObject() { close('}'); }
+  void BeginArray() { open('['); }
+  void EndArray() { close(']'); }
+
+  // Name the next value, which must be in an object.
+  JsonWriter& Key(const char* key);
+
+  void String(const char* str);
+  void Int(long value);
+  void Uint(unsigned long value);
+  void Bool(bool value);
+  void Null();
+
+  // End a line, as after each record of NDJSON. The next value starts
+  // afresh rather than after a comma.
+  void Newline();
+
+  const std::string& Buffer() const { return buffer_; }
+
+  // Start over, dropping everything built so far.
+  void Clear() {
+    buffer_.clear();
+    separate_ = false;
+  }
+
+  // Write everything built so far to fd, in one write unless it's cut
+  // short, and start over. Returns false if it couldn't all be written.
+  bool Flush(int fd);
+
+ private:
+  void open(char bracket);
+  void close(char bracket);
+  void separate();
+
+  std::string buffer_;
+
+  // Whether a value has been written since the last opening bracket, key or
+  // newline, and so the next one needs a comma.
+  bool separate_ = false;
+};
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,101 @@
+#include "daemon.h"
+#include "ponymix.h"
+#include "snapshot.h"
+#include "timings.h"
+
+// C
+#include <stdlib.h>
+
+// C++
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Whether a daemon, if one is running, should run this command line for us.
+static bool forwardable(const CommandLineScan& scan) {
+  // Watching and metering are long-lived anyway, and better done on a
+  // connection of their own from the start.
+  for (const std::string& command : scan.commands) {
+    if (command == "help" || command == "version" || command == "daemon" ||
+        command == "watch" || command == "meter") {
+      return false;
+    }
+  }
+
+  // Timings are of this process's own work, not of handing it off.
+  return !scan.timed && !Timings::enabled();
+}
+
+// Whether this command line only reads what a daemon's snapshot holds.
+static bool snapshot_readable(const std::vector<std::string>& commands) {
+  static const char* const readers[] = {
+    "defaults", "list", "list-short", "get-volume", "get-balance",
+    "is-muted", "is-available",
+  };
+
+  for (const std::string& command : commands) {
+    if (std::find(std::begin(readers), std::end(readers), command) ==
+        std::end(readers)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether this command line may change what a daemon's snapshot holds.
+static bool changes_snapshot(const std::vector<std::string>& commands) {
+  static const char* const writers[] = {
+    "set-volume", "fade", "set-balance", "adj-balance", "increase",
+    "decrease", "mute", "unmute", "toggle", "set-default", "set-profile",
+    "move", "move-all", "kill", "batch",
+  };
+
+  for (const std::string& command : commands) {
+    if (std::find(std::begin(writers), std::end(writers), command) !=
+        std::end(writers)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Load the snapshot published by a running daemon in place of fetching
+// anything from the server.
+static SnapshotStatus load_snapshot(PulseClient& ponymix) {
+  Phase phase("snapshot");
+  std::string snapshot;
+  SnapshotStatus status = ReadSnapshot(&snapshot);
+  if (status == SnapshotStatus::OK && !ponymix.LoadSnapshot(snapshot)) {
+    status = SnapshotStatus::UNAVAILABLE;
+  }
+  return status;
+}
+
+int main(int argc, char* argv[]) {
+  const char* timings = getenv("PONYMIX_TIMINGS");
+  if (timings != nullptr && *timings != '\0') Timings::Enable();
+
+  PulseClient ponymix("ponymix");
+
+  CommandLineScan scan;
+  if (ScanCommandLine(argc, argv, &scan)) {
+    if (snapshot_readable(scan.commands)) {
+      // A snapshot which is behind means asking the server directly, as
+      // the daemon would answer from the same stale state.
+      if (load_snapshot(ponymix) != SnapshotStatus::UNAVAILABLE) {
+        return RunCommandLine(ponymix, argc, argv);
+      }
+    } else if (changes_snapshot(scan.commands)) {
+      AwaitSnapshotUpdate();
+    }
+
+    int status;
+    if (forwardable(scan) && ForwardToDaemon(argc, argv, &status)) {
+      return status;
+    }
+  }
+
+  return RunCommandLine(ponymix, argc, argv);
+}
+
+// vim: set et ts=2 sw=2:
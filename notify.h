@@ -3,7 +3,18 @@
 #include <stdio.h>
 
 #ifdef HAVE_NOTIFY
+#include <dlfcn.h>
+#include <err.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include <libnotify/notify.h>
+
+#include "timings.h"
 #endif
 
 enum class NotificationType {
@@ -46,14 +57,87 @@ class CommandLineNotifier : public Notifier {
 };
 
 #ifdef HAVE_NOTIFY
+// The parts of libnotify we use. It drags in glib, gobject and more, so
+// rather than linking against it, it's loaded the first time a
+// notification is shown.
+struct Libnotify {
+  decltype(&notify_init) init;
+  decltype(&notify_uninit) uninit;
+  decltype(&notify_notification_new) notification_new;
+  decltype(&notify_notification_update) notification_update;
+  decltype(&notify_notification_set_timeout) notification_set_timeout;
+  decltype(&notify_notification_set_urgency) notification_set_urgency;
+  decltype(&notify_notification_set_hint_int32) notification_set_hint_int32;
+  decltype(&notify_notification_set_hint_string) notification_set_hint_string;
+  decltype(&notify_notification_show) notification_show;
+  decltype(&g_object_unref) object_unref;
+
+  // Returns null, having said why, if libnotify can't be loaded. It's never
+  // unloaded, as glib doesn't cope with that.
+  static std::unique_ptr<Libnotify> Load() {
+    void* handle = dlopen("libnotify.so.4", RTLD_LAZY | RTLD_LOCAL);
+    if (handle == nullptr) {
+      warnx("failed to load libnotify: %s", dlerror());
+      return nullptr;
+    }
+
+    std::unique_ptr<Libnotify> lib(new Libnotify);
+    if (!resolve(handle, "notify_init", &lib->init) ||
+        !resolve(handle, "notify_uninit", &lib->uninit) ||
+        !resolve(handle, "notify_notification_new", &lib->notification_new) ||
+        !resolve(handle, "notify_notification_update", &lib->notification_update) ||
+        !resolve(handle, "notify_notification_set_timeout",
+                 &lib->notification_set_timeout) ||
+        !resolve(handle, "notify_notification_set_urgency",
+                 &lib->notification_set_urgency) ||
+        !resolve(handle, "notify_notification_set_hint_int32",
+                 &lib->notification_set_hint_int32) ||
+        !resolve(handle, "notify_notification_set_hint_string",
+                 &lib->notification_set_hint_string) ||
+        !resolve(handle, "notify_notification_show", &lib->notification_show) ||
+        !resolve(handle, "g_object_unref", &lib->object_unref)) {
+      return nullptr;
+    }
+
+    return lib;
+  }
+
+ private:
+  template<typename T>
+  static bool resolve(void* handle, const char* symbol, T* fn) {
+    *fn = reinterpret_cast<T>(dlsym(handle, symbol));
+    if (*fn == nullptr) warnx("failed to load libnotify: %s", dlerror());
+    return *fn != nullptr;
+  }
+};
+
+// Announces changes with a single notification, updated in place. The
+// D-Bus round trip happens on a worker thread so as not to hold up the
+// change itself, and if changes come faster than they can be shown, only
+// the latest is.
 class LibnotifyNotifier : public Notifier {
  public:
-  LibnotifyNotifier() {
-    notify_init("ponymix");
+  LibnotifyNotifier() :
+      queue_(std::make_shared<Queue>()),
+      worker_(run, queue_) {
   }
 
   virtual ~LibnotifyNotifier() {
-    notify_uninit();
+    Phase phase("notify");
+    std::unique_lock<std::mutex> lock(queue_->mutex);
+    queue_->stopping = true;
+    queue_->wakeup.notify_one();
+
+    // Let the last change go out, but don't hang on a D-Bus which doesn't
+    // answer. The worker only touches the queue, which it shares.
+    if (queue_->finished_cv.wait_for(lock, std::chrono::milliseconds(500),
+                                     [this] { return queue_->finished; })) {
+      lock.unlock();
+      worker_.join();
+    } else {
+      lock.unlock();
+      worker_.detach();
+    }
   }
 
   virtual void Notify(enum NotificationType type, long value, bool mute) const {
@@ -62,14 +146,74 @@ class LibnotifyNotifier : public Notifier {
       break;
     case NotificationType::VOLUME:
     case NotificationType::UNMUTE:
-    case NotificationType::MUTE:
-      volchange(value, mute);
+    case NotificationType::MUTE: {
+      std::lock_guard<std::mutex> lock(queue_->mutex);
+      queue_->volume = value;
+      queue_->mute = mute;
+      queue_->pending = true;
+      queue_->wakeup.notify_one();
       break;
     }
+    }
   }
 
  private:
-  void volchange(long vol, bool mute) const {
+  struct Queue {
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable finished_cv;
+    long volume = 0;
+    bool mute = false;
+    bool pending = false;
+    bool stopping = false;
+    bool finished = false;
+  };
+
+  static void run(std::shared_ptr<Queue> queue) {
+    std::unique_ptr<Libnotify> lib;
+    bool loaded = false;
+    NotifyNotification* notification = nullptr;
+
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    for (;;) {
+      queue->wakeup.wait(lock, [&] { return queue->pending || queue->stopping; });
+      if (!queue->pending) break;
+
+      const long vol = queue->volume;
+      const bool mute = queue->mute;
+      queue->pending = false;
+      lock.unlock();
+
+      // Nothing is set up until there's something to show.
+      if (!loaded) {
+        loaded = true;
+        lib = Libnotify::Load();
+        if (lib) {
+          lib->init("ponymix");
+          notification = lib->notification_new("ponymix", "", nullptr);
+          lib->notification_set_timeout(notification, 1000);
+          lib->notification_set_urgency(notification, NOTIFY_URGENCY_NORMAL);
+          lib->notification_set_hint_string(notification, "synchronous", "volume");
+        }
+      }
+      if (lib) volchange(*lib, notification, vol, mute);
+
+      lock.lock();
+    }
+    lock.unlock();
+
+    if (lib) {
+      lib->object_unref(notification);
+      lib->uninit();
+    }
+
+    lock.lock();
+    queue->finished = true;
+    queue->finished_cv.notify_one();
+  }
+
+  static void volchange(const Libnotify& lib, NotifyNotification* notification,
+                        long vol, bool mute) {
     const char* icon = "notification-audio-volume-muted";
 
     if (!mute) {
@@ -82,14 +226,13 @@ class LibnotifyNotifier : public Notifier {
       }
     }
 
-    NotifyNotification* notification = notify_notification_new("ponymix", "", icon);
-    notify_notification_set_timeout(notification, 1000);
-    notify_notification_set_urgency(notification, NOTIFY_URGENCY_NORMAL);
-    notify_notification_set_hint_int32(notification, "value", vol);
-    notify_notification_set_hint_string(notification, "synchronous", "volume");
-    notify_notification_show(notification, nullptr);
-    g_object_unref(G_OBJECT(notification));
+    lib.notification_update(notification, "ponymix", "", icon);
+    lib.notification_set_hint_int32(notification, "value", vol);
+    lib.notification_show(notification, nullptr);
   }
+
+  std::shared_ptr<Queue> queue_;
+  std::thread worker_;
 };
 #endif
 
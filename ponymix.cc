@@ -1,15 +1,26 @@
-#include "pulse.h"
+#include "ponymix.h"
 
+#include "coalesce.h"
+#include "daemon.h"
+#include "devcache.h"
+#include "timings.h"
+
+#include <ctype.h>
 #include <err.h>
 #include <getopt.h>
+#include <math.h>
 #include <unistd.h>
 
 #include <map>
 #include <stdexcept>
-
-struct Command {
-  int (*fn)(PulseClient&, int, char*[]);
-  Range<int> args;
+#include <vector>
+
+// How listings are printed: for people, as JSON, or as newline-delimited
+// JSON with one record per line.
+enum class OutputFormat {
+  TEXT,
+  JSON,
+  NDJSON,
 };
 
 struct Color {
@@ -55,8 +66,22 @@ static bool opt_listrestrict;
 static bool opt_short;
 static const char* opt_action;
 static const char* opt_device;
+static bool opt_all;
+static const char* opt_match;
+static std::vector<const char*> opt_props;
 static const char* opt_card;
 static bool opt_notify;
+static bool opt_async;
+static const char* opt_format;
+static long opt_window;
+static long opt_rate;
+static bool opt_raw;
+static long opt_duration;
+static FadeCurve opt_curve;
+static bool opt_coalesce;
+static bool opt_remember;
+static bool opt_move_streams;
+static OutputFormat opt_output;
 static long opt_maxvolume;
 static Color color;
 
@@ -101,21 +126,123 @@ static DeviceType string_to_devtype_or_die(const char* str) {
   }
 }
 
+// Fill in the default device for the selected device type unless one was
+// given explicitly. This is deferred until a command actually needs a device
+// so that other commands don't pay for fetching the server info.
+static void resolve_default_device(PulseClient& ponymix) {
+  if (opt_device != nullptr) return;
+
+  // The server understands these aliases itself, which saves us asking it
+  // for the server info first.
+  switch (opt_devtype) {
+  case DeviceType::SINK:
+    opt_device = "@DEFAULT_SINK@";
+    break;
+  case DeviceType::SOURCE:
+    opt_device = "@DEFAULT_SOURCE@";
+    break;
+  default:
+    opt_device = ponymix.GetDefaults().GetDefault(opt_devtype).c_str();
+    break;
+  }
+}
+
 static Device* string_to_device_or_die(PulseClient& ponymix,
-                                       std::string arg,
+                                       const char* arg,
                                        DeviceType type) {
+  if (arg == nullptr) {
+    resolve_default_device(ponymix);
+    arg = opt_device;
+  }
+
   Device* device = ponymix.GetDevice(arg, type);
-  if (device == nullptr) errx(1, "no match found for device: %s", arg.c_str());
+  if (device == nullptr) errx(1, "no match found for device: %s", arg);
   return device;
 }
 
-static void Print(const Device& device) {
+// Whether --all, --match or --prop picked out a set of devices to work on,
+// in place of a single device.
+static bool selecting() {
+  return opt_all || opt_match != nullptr || !opt_props.empty();
+}
+
+static std::vector<Device*> select_devices_or_die(PulseClient& ponymix,
+                                                  DeviceType type) {
+  if (opt_device != nullptr) {
+    errx(1, "error: --device can't be combined with --all, --match or --prop");
+  }
+
+  std::vector<Device*> devices = ponymix.SelectDevices(type, opt_match, opt_props);
+  if (devices.empty() && !(opt_all && opt_match == nullptr && opt_props.empty())) {
+    errx(1, "no match found for selection");
+  }
+  return devices;
+}
+
+// Apply a change to each selected device. All of the changes are sent before
+// waiting on any of them.
+static bool change_selected(PulseClient& ponymix, DeviceType type,
+                            const std::function<bool(Device&)>& change) {
+  std::vector<Device*> devices = select_devices_or_die(ponymix, type);
+
+  bool success = true;
+  ponymix.SetAsync(true);
+  for (Device* device : devices) {
+    if (!change(*device)) success = false;
+  }
+  ponymix.SetAsync(opt_async);
+
+  return (opt_async || ponymix.Flush()) && success;
+}
+
+// Apply a change to the selected device. With --remember, a sink or
+// source given by its exact name is changed as it was last time, without
+// being looked up first. See PulseClient::ChangeRemembered.
+static bool change_device(PulseClient& ponymix,
+                          const std::function<bool(Device&)>& change) {
+  if (selecting()) return change_selected(ponymix, opt_devtype, change);
+
+  // The default device can move under an alias at any time, so what it
+  // meant last time is no guide.
+  long index;
+  if (!opt_remember ||
+      (opt_devtype != DeviceType::SINK && opt_devtype != DeviceType::SOURCE) ||
+      opt_device == nullptr || opt_device[0] == '@' ||
+      xstrtol(opt_device, &index) == 0 || opt_async) {
+    return change(*string_to_device_or_die(ponymix, opt_device, opt_devtype));
+  }
+
+  const std::string selector = opt_device;
+  DeviceCache cache(type_to_string(opt_devtype) + (":" + selector));
+
+  std::string memo;
+  if (cache.Load(&memo)) {
+    switch (ponymix.ChangeRemembered(&memo, selector, change)) {
+    case PulseClient::ChangeResult::CHANGED:
+      cache.Store(memo);
+      return true;
+    case PulseClient::ChangeResult::FAILED:
+      return false;
+    case PulseClient::ChangeResult::STALE:
+      break;
+    }
+  }
+
+  Device* device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
+  if (!change(*device)) return false;
+
+  // Only an exact name is sure to pick the same device again.
+  if (selector == device->Name()) cache.Store(ponymix.RememberDevice(*device));
+  return true;
+}
+
+void Print(const Device& device) {
   if (opt_short) {
     printf("%s\t%d\t%s\t%s\n",
            type_to_string(device.Type()),
            device.Index(),
-           device.Name().c_str(),
-           device.Desc().c_str());
+           device.Name(),
+           device.Desc());
     return;
   }
 
@@ -143,8 +270,8 @@ static void Print(const Device& device) {
          type_to_string(device.Type()),
          device.Index(),
          color.reset,
-         device.Name().c_str(),
-         device.Desc().c_str(),
+         device.Name(),
+         device.Desc(),
          volume_color,
          device.Volume(),
          color.reset,
@@ -153,9 +280,9 @@ static void Print(const Device& device) {
          color.reset);
 }
 
-static void Print(const Card& card) {
+void Print(const Card& card) {
   if (opt_short) {
-    printf("%s\n", card.Name().c_str());
+    printf("%s\n", card.Name());
     return;
   }
 
@@ -165,15 +292,15 @@ static void Print(const Card& card) {
          color.name,
          card.Index(),
          color.reset,
-         card.Name().c_str(),
-         card.Driver().c_str(),
-         card.ActiveProfile().name.c_str());
+         card.Name(),
+         card.Driver(),
+         card.ActiveProfile().name);
 
 }
 
 static void Print(const Profile& profile, bool active) {
   if (opt_short) {
-    printf("%s\n", profile.name.c_str());
+    printf("%s\n", profile.name);
     return;
   }
 
@@ -181,40 +308,219 @@ static void Print(const Profile& profile, bool active) {
   printf("%s%s%s%s%s%s\n"
          "  %s\n",
          color.name,
-         profile.name.c_str(),
+         profile.name,
          color.reset,
          color.low,
          active_str,
          color.reset,
-         profile.desc.c_str());
+         profile.desc);
 }
 
+static void Print(const ServerInfo&, const Device* sink, const Device* source) {
+  Print(*sink);
+  Print(*source);
+}
+
+static const char* availability_to_string(Device::Availability a) {
+  switch (a) {
+  case Device::Availability::UNKNOWN:
+    return "unknown";
+  case Device::Availability::NO:
+    return "no";
+  case Device::Availability::YES:
+    return "yes";
+  }
+
+  throw unreachable();
+}
+
+// An index which may be PA_INVALID_INDEX, written as null if it is.
+static void WriteIndex(JsonWriter& json, const char* key, uint32_t index) {
+  json.Key(key);
+  if (index == PA_INVALID_INDEX) {
+    json.Null();
+  } else {
+    json.Uint(index);
+  }
+}
+
+// The properties which are set, keyed by name.
+static void WriteProps(JsonWriter& json, StringList props) {
+  json.Key("properties").BeginObject();
+  size_t i = 0;
+  for (const char* value : props) {
+    if (i == kMaxMatchProps) break;
+    const char* key = kMatchProps[i++];
+    if (*value != '\0') json.Key(key).String(value);
+  }
+  json.EndObject();
+}
+
+void Write(JsonWriter& json, const Device& device) {
+  json.BeginObject();
+  json.Key("type").String(type_to_string(device.Type()));
+  json.Key("index").Uint(device.Index());
+  json.Key("name").String(device.Name());
+  json.Key("description").String(device.Desc());
+  json.Key("volume").Int(device.Volume());
+  json.Key("balance").Int(device.Balance());
+  json.Key("muted").Bool(device.Muted());
+  json.Key("available").String(availability_to_string(device.Available()));
+
+  // Each channel's volume, in percent like the average and as the server
+  // has it.
+  const pa_cvolume volume = device.ChannelVolumes();
+  const pa_channel_map channels = device.ChannelMap();
+  json.Key("channels").BeginArray();
+  for (uint8_t i = 0; i < volume.channels; i++) {
+    json.BeginObject();
+    json.Key("position").String(pa_channel_position_to_string(channels.map[i]));
+    json.Key("volume").Int(lround(volume.values[i] * 100.0 / PA_VOLUME_NORM));
+    json.Key("value").Uint(volume.values[i]);
+    json.EndObject();
+  }
+  json.EndArray();
+
+  WriteIndex(json, "card", device.CardIndex());
+  WriteIndex(json, "monitor", device.MonitorIndex());
+  WriteIndex(json, "owner", device.OwnerIndex());
+  WriteProps(json, device.Props());
+  json.EndObject();
+}
+
+static void Write(JsonWriter& json, const Profile& profile, bool active) {
+  json.BeginObject();
+  json.Key("name").String(profile.name);
+  json.Key("description").String(profile.desc);
+  json.Key("active").Bool(active);
+  json.EndObject();
+}
+
+void Write(JsonWriter& json, const Card& card) {
+  const char* active = card.ActiveProfile().name;
+
+  json.BeginObject();
+  json.Key("index").Uint(card.Index());
+  json.Key("name").String(card.Name());
+  json.Key("description").String(card.Desc());
+  json.Key("driver").String(card.Driver());
+  WriteIndex(json, "module", card.OwnerModule());
+  json.Key("active_profile");
+  if (*active == '\0') {
+    json.Null();
+  } else {
+    json.String(active);
+  }
+  json.Key("profiles").BeginArray();
+  for (const Profile p : card.Profiles()) Write(json, p, strcmp(p.name, active) == 0);
+  json.EndArray();
+  WriteProps(json, card.Props());
+  json.EndObject();
+}
+
+static void Write(JsonWriter& json, const ServerInfo& info, const Device* sink,
+                  const Device* source) {
+  json.BeginObject();
+  json.Key("cookie").Uint(info.cookie);
+  json.Key("sink");
+  if (sink == nullptr) {
+    json.Null();
+  } else {
+    Write(json, *sink);
+  }
+  json.Key("source");
+  if (source == nullptr) {
+    json.Null();
+  } else {
+    Write(json, *source);
+  }
+  json.EndObject();
+}
+
+// What a listing prints: each record as text as it comes, or, with
+// --output-format, as a JSON array or one JSON object per line, gathered in
+// one buffer and written at once by Finish().
+class Records {
+ public:
+  // Room for a device or card record with a few channels and profiles.
+  static const size_t kRecordSize = 512;
+
+  // As JSON, records form an array, unless there's only ever the one,
+  // which stands bare.
+  explicit Records(size_t count, bool array = true) :
+      json_(opt_output == OutputFormat::TEXT ? 0 : (count + 1) * kRecordSize),
+      array_(array && opt_output == OutputFormat::JSON) {
+    if (array_) json_.BeginArray();
+  }
+
+  template<typename... Args>
+  void Add(const Args&... args) {
+    if (opt_output == OutputFormat::TEXT) {
+      Print(args...);
+      return;
+    }
+
+    Write(json_, args...);
+    if (opt_output == OutputFormat::NDJSON) json_.Newline();
+  }
+
+  int Finish() {
+    if (opt_output == OutputFormat::TEXT) return 0;
+
+    if (array_) json_.EndArray();
+    if (opt_output == OutputFormat::JSON) json_.Newline();
+
+    // Anything printed before must come out first.
+    fflush(stdout);
+    if (!json_.Flush(STDOUT_FILENO)) {
+      warn("failed to write output");
+      return 1;
+    }
+    return 0;
+  }
+
+ private:
+  JsonWriter json_;
+  const bool array_;
+};
+
 static int ShowDefaults(PulseClient& ponymix, int, char*[]) {
   const auto& info = ponymix.GetDefaults();
-  Print(*ponymix.GetSink(info.sink));
-  Print(*ponymix.GetSource(info.source));
-  return 0;
+  Records records(1, false);
+  records.Add(info, ponymix.GetSink(info.sink), ponymix.GetSource(info.source));
+  return records.Finish();
 }
 
 static int List(PulseClient& ponymix, int, char*[]) {
   if (opt_listrestrict) {
-    for (const auto& d : ponymix.GetDevices(opt_devtype)) Print(d);
-    return 0;
+    const auto& devices = ponymix.GetDevices(opt_devtype);
+    Records records(devices.size());
+    for (const auto& d : devices) records.Add(d);
+    return records.Finish();
   }
 
-  for (const auto& s : ponymix.GetSinks()) Print(s);
-  for (const auto& s : ponymix.GetSources()) Print(s);
-  for (const auto& s : ponymix.GetSinkInputs()) Print(s);
-  for (const auto& s : ponymix.GetSourceOutputs()) Print(s);
+  ponymix.PopulateDevices();
+  const auto& sinks = ponymix.GetSinks();
+  const auto& sources = ponymix.GetSources();
+  const auto& sink_inputs = ponymix.GetSinkInputs();
+  const auto& source_outputs = ponymix.GetSourceOutputs();
 
-  return 0;
+  Records records(sinks.size() + sources.size() + sink_inputs.size() +
+                  source_outputs.size());
+  for (const auto& s : sinks) records.Add(s);
+  for (const auto& s : sources) records.Add(s);
+  for (const auto& s : sink_inputs) records.Add(s);
+  for (const auto& s : source_outputs) records.Add(s);
+
+  return records.Finish();
 }
 
 static int ListCards(PulseClient& ponymix, int, char*[]) {
   const auto& cards = ponymix.GetCards();
-  for (const auto& c : cards) Print(c);
+  Records records(cards.size());
+  for (const auto& c : cards) records.Add(c);
 
-  return 0;
+  return records.Finish();
 }
 
 static Card* resolve_active_card_or_die(PulseClient& ponymix) {
@@ -237,9 +543,12 @@ static int ListProfiles(PulseClient& ponymix, int, char*[]) {
   auto card = resolve_active_card_or_die(ponymix);
 
   const auto& profiles = card->Profiles();
-  for (const auto& p : profiles) Print(p, p.name == card->ActiveProfile().name);
+  const char* active = card->ActiveProfile().name;
+  Records records(0);
+  for (const Profile p : profiles) records.Add(p, strcmp(p.name, active) == 0);
 
-  return 0;}
+  return records.Finish();
+}
 
 static int GetVolume(PulseClient& ponymix, int, char*[]) {
   auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
@@ -248,16 +557,29 @@ static int GetVolume(PulseClient& ponymix, int, char*[]) {
 }
 
 static int SetVolume(PulseClient& ponymix, int, char* argv[]) {
+  long volume;
+  try {
+    volume = std::stol(argv[0]);
+  } catch (std::invalid_argument) {
+    errx(1, "error: failed to convert string to integer: %s", argv[0]);
+  }
+
+  return !change_device(ponymix, [&](Device& device) {
+    return ponymix.SetVolume(device, volume);
+  });
+}
+
+static int FadeVolume(PulseClient& ponymix, int, char* argv[]) {
   auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
 
   long volume;
   try {
     volume = std::stol(argv[0]);
-  } catch (std::invalid_argument) {
+  } catch (const std::invalid_argument&) {
     errx(1, "error: failed to convert string to integer: %s", argv[0]);
   }
 
-  return !ponymix.SetVolume(*device, volume);
+  return !ponymix.FadeVolume(*device, volume, opt_duration, opt_curve);
 }
 
 static int GetBalance(PulseClient& ponymix, int, char*[]) {
@@ -267,8 +589,6 @@ static int GetBalance(PulseClient& ponymix, int, char*[]) {
 }
 
 static int SetBalance(PulseClient& ponymix, int, char* argv[]) {
-  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
-
   long balance;
   try {
     balance = std::stol(argv[0]);
@@ -276,12 +596,12 @@ static int SetBalance(PulseClient& ponymix, int, char* argv[]) {
     errx(1, "error: failed to convert string to integer: %s", argv[0]);
   }
 
-  return !ponymix.SetBalance(*device, balance);
+  return !change_device(ponymix, [&](Device& device) {
+    return ponymix.SetBalance(device, balance);
+  });
 }
 
 static int AdjBalance(PulseClient& ponymix, int, char* argv[]) {
-  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
-
   long balance;
   try {
     balance = std::stol(argv[0]);
@@ -289,14 +609,43 @@ static int AdjBalance(PulseClient& ponymix, int, char* argv[]) {
     errx(1, "error: failed to convert string to integer: %s", argv[0]);
   }
 
-  return !ponymix.SetBalance(*device, device->Balance() + balance);
+  return !change_device(ponymix, [&](Device& device) {
+    return ponymix.SetBalance(device, device.Balance() + balance);
+  });
+}
+
+// Merge an adjustment with those of other invocations adjusting the same
+// device at the same time. Only the first of them talks to PulseAudio,
+// applying the net adjustment once per window until the others stop.
+static int coalesce_volume(PulseClient& ponymix,
+                           bool (PulseClient::*adjust)(Device&, long int),
+                           long delta) {
+  if (adjust == &PulseClient::DecreaseVolume) delta = -delta;
+
+  Coalescer coalescer(type_to_string(opt_devtype) + std::string(":") +
+                      (opt_device ? opt_device : ""));
+  if (coalescer.Offer(delta)) return 0;
+
+  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
+
+  int status = 0;
+  for (;;) {
+    ponymix.SetVolumeRange(0, std::max(device->Volume(), static_cast<int>(opt_maxvolume)));
+    if (delta != 0 && !ponymix.IncreaseVolume(*device, delta)) status = 1;
+    if (!coalescer.Take(opt_window, &delta)) break;
+
+    // Another client may have changed the volume during the window, so
+    // adjust it from where it is now rather than where we left it.
+    device = ponymix.RefreshDevice(*device);
+    if (device == nullptr) errx(1, "error: device went away while adjusting it");
+  }
+
+  return status;
 }
 
 static int adj_volume(PulseClient& ponymix,
                       bool (PulseClient::*adjust)(Device&, long int),
                       char* argv[]) {
-  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
-
   long delta;
   try {
     delta = std::stol(argv[0]);
@@ -304,10 +653,14 @@ static int adj_volume(PulseClient& ponymix,
     errx(1, "error: failed to convert string to integer: %s", argv[0]);
   }
 
-  // Allow setting the volume over 100, but don't "clip" the level back down to
-  // 100 on adjustment.
-  ponymix.SetVolumeRange(0, std::max(device->Volume(), static_cast<int>(opt_maxvolume)));
-  return !(ponymix.*adjust)(*device, delta);
+  if (opt_coalesce && !selecting()) return coalesce_volume(ponymix, adjust, delta);
+
+  return !change_device(ponymix, [&](Device& device) {
+    // Allow setting the volume over 100, but don't "clip" the level back down
+    // to 100 on adjustment.
+    ponymix.SetVolumeRange(0, std::max(device.Volume(), static_cast<int>(opt_maxvolume)));
+    return (ponymix.*adjust)(device, delta);
+  });
 }
 
 static int IncreaseVolume(PulseClient& ponymix, int, char* argv[]) {
@@ -319,18 +672,21 @@ static int DecreaseVolume(PulseClient& ponymix, int, char* argv[]) {
 }
 
 static int Mute(PulseClient& ponymix, int, char*[]) {
-  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
-  return !ponymix.SetMute(*device, true);
+  return !change_device(ponymix, [&](Device& device) {
+    return ponymix.SetMute(device, true);
+  });
 }
 
 static int Unmute(PulseClient& ponymix, int, char*[]) {
-  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
-  return !ponymix.SetMute(*device, false);
+  return !change_device(ponymix, [&](Device& device) {
+    return ponymix.SetMute(device, false);
+  });
 }
 
 static int ToggleMute(PulseClient& ponymix, int, char*[]) {
-  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
-  return !ponymix.SetMute(*device, !ponymix.IsMuted(*device));
+  return !change_device(ponymix, [&](Device& device) {
+    return ponymix.SetMute(device, !ponymix.IsMuted(device));
+  });
 }
 
 static int IsMuted(PulseClient& ponymix, int, char*[]) {
@@ -340,12 +696,21 @@ static int IsMuted(PulseClient& ponymix, int, char*[]) {
 
 static int SetDefault(PulseClient& ponymix, int, char*[]) {
   auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
-  return !ponymix.SetDefault(*device);
+  if (!opt_move_streams) return !ponymix.SetDefault(*device);
+
+  // The new default goes out along with the moves, rather than ahead of
+  // them.
+  ponymix.SetAsync(true);
+  bool success = ponymix.SetDefault(*device);
+  ponymix.SetAsync(opt_async);
+
+  if (!ponymix.MoveStreams(*device)) success = false;
+  return !((opt_async || ponymix.Flush()) && success);
 }
 
 static int GetProfile(PulseClient& ponymix, int, char*[]) {
   auto card = resolve_active_card_or_die(ponymix);
-  printf("%s\n", card->ActiveProfile().name.c_str());
+  printf("%s\n", card->ActiveProfile().name);
 
   return true;
 }
@@ -356,6 +721,10 @@ static int SetProfile(PulseClient& ponymix, int, char* argv[]) {
 }
 
 static int Move(PulseClient& ponymix, int, char* argv[]) {
+  // The default device is chosen by the type given on the command line, not
+  // the stream type we infer below.
+  if (!selecting()) resolve_default_device(ponymix);
+
   // this assignment is a lie. stfu g++
   DeviceType target_devtype = opt_devtype;
   switch (opt_devtype) {
@@ -371,6 +740,13 @@ static int Move(PulseClient& ponymix, int, char* argv[]) {
     break;
   }
 
+  if (selecting()) {
+    auto target = string_to_device_or_die(ponymix, argv[0], target_devtype);
+    return !change_selected(ponymix, opt_devtype, [&](Device& stream) {
+      return ponymix.Move(stream, *target);
+    });
+  }
+
   // Does this even work?
   auto source = string_to_device_or_die(ponymix, opt_device, opt_devtype);
   auto target = string_to_device_or_die(ponymix, argv[0], target_devtype);
@@ -378,7 +754,26 @@ static int Move(PulseClient& ponymix, int, char* argv[]) {
   return !ponymix.Move(*source, *target);
 }
 
+static int MoveAll(PulseClient& ponymix, int, char*[]) {
+  // As with move, the streams' type stands for where they're going.
+  switch (opt_devtype) {
+  case DeviceType::SINK_INPUT:
+    opt_devtype = DeviceType::SINK;
+    break;
+  case DeviceType::SOURCE_OUTPUT:
+    opt_devtype = DeviceType::SOURCE;
+    break;
+  default:
+    break;
+  }
+
+  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
+  return !ponymix.MoveStreams(*device);
+}
+
 static int Kill(PulseClient& ponymix, int, char*[]) {
+  if (!selecting()) resolve_default_device(ponymix);
+
   switch (opt_devtype) {
   case DeviceType::SOURCE:
     opt_devtype = DeviceType::SOURCE_OUTPUT;
@@ -390,6 +785,12 @@ static int Kill(PulseClient& ponymix, int, char*[]) {
     break;
   }
 
+  if (selecting()) {
+    return !change_selected(ponymix, opt_devtype, [&](Device& stream) {
+      return ponymix.Kill(stream);
+    });
+  }
+
   auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
 
   return !ponymix.Kill(*device);
@@ -400,6 +801,186 @@ static int IsAvailable(PulseClient& ponymix, int, char*[]) {
   return ponymix.Availability(*device) == Device::Availability::YES;
 }
 
+// Expand a --format string for a device.
+static std::string format_device(const Device& device, const char* format) {
+  std::string out;
+  for (const char* p = format; *p != '\0'; p++) {
+    if (*p != '%' || p[1] == '\0') {
+      out.push_back(*p);
+      continue;
+    }
+
+    switch (*++p) {
+    case 'i':
+      out += std::to_string(device.Index());
+      break;
+    case 't':
+      out += type_to_string(device.Type());
+      break;
+    case 'n':
+      out += device.Name();
+      break;
+    case 'd':
+      out += device.Desc();
+      break;
+    case 'v':
+      out += std::to_string(device.Volume());
+      break;
+    case 'b':
+      out += std::to_string(device.Balance());
+      break;
+    case 'm':
+      out += device.Muted() ? "muted" : "unmuted";
+      break;
+    default:
+      if (*p != '%') out.push_back('%');
+      out.push_back(*p);
+      break;
+    }
+  }
+  return out;
+}
+
+static int Watch(PulseClient& ponymix, int, char*[]) {
+  // Anything fetched from here on is kept current.
+  ponymix.Subscribe();
+  ponymix.GetDevices(opt_devtype);
+
+  // Without a device, follow the default sink or source, or watch all
+  // streams of the given type.
+  const bool follow_default = opt_device == nullptr &&
+      (opt_devtype == DeviceType::SINK || opt_devtype == DeviceType::SOURCE);
+  if (follow_default) ponymix.GetDefaults();
+
+  uint32_t index = PA_INVALID_INDEX;
+  if (opt_device != nullptr) {
+    index = string_to_device_or_die(ponymix, opt_device, opt_devtype)->Index();
+  }
+
+  // Print a line for each device whose line differs from the last one.
+  std::map<uint32_t, std::string> shown;
+  auto report = [&]() {
+    std::vector<const Device*> devices;
+    if (index != PA_INVALID_INDEX) {
+      const Device* device = ponymix.GetDevice(index, opt_devtype);
+      if (device == nullptr) errx(1, "error: device went away: %s", opt_device);
+      devices.push_back(device);
+    } else if (follow_default) {
+      const std::string& name = ponymix.GetDefaults().GetDefault(opt_devtype);
+      const Device* device =
+          name.empty() ? nullptr : ponymix.GetDevice(name, opt_devtype);
+      if (device != nullptr) devices.push_back(device);
+    } else {
+      for (const Device& device : ponymix.GetDevices(opt_devtype)) {
+        devices.push_back(&device);
+      }
+    }
+
+    std::map<uint32_t, std::string> lines;
+    for (const Device* device : devices) {
+      std::string line = format_device(*device, opt_format);
+      auto iter = shown.find(device->Index());
+      if (iter == shown.end() || iter->second != line) puts(line.c_str());
+      lines[device->Index()] = std::move(line);
+    }
+    shown = std::move(lines);
+    fflush(stdout);
+  };
+
+  report();
+  ponymix.SetChangeCallback(report, opt_window);
+  return ponymix.Run();
+}
+
+static int Meter(PulseClient& ponymix, int, char*[]) {
+  auto device = string_to_device_or_die(ponymix, opt_device, opt_devtype);
+
+  // On a terminal, redraw the bar in place rather than scrolling.
+  const bool redraw = !opt_raw && isatty(fileno(stdout));
+  auto report = [redraw](float level) {
+    if (opt_raw) {
+      printf("%.4f\n", level);
+    } else {
+      const int width = 50;
+      const int filled = std::min(width, static_cast<int>(lround(level * width)));
+      printf("%s[%s%s] %3ld%%%s", redraw ? "\r" : "",
+          std::string(filled, '#').c_str(),
+          std::string(width - filled, ' ').c_str(),
+          lround(level * 100), redraw ? "" : "\n");
+    }
+    fflush(stdout);
+  };
+
+  if (!ponymix.MonitorPeaks(*device, opt_rate, report)) return 1;
+  return ponymix.Run();
+}
+
+static int run_commands(PulseClient& ponymix, int argc, char* argv[]);
+
+static int Daemon(PulseClient& ponymix, int, char*[]) {
+  return RunDaemon(ponymix, RunCommandLine);
+}
+
+// Split a line of a batch script into words. Words are separated by
+// whitespace and may be quoted with single or double quotes. A word
+// starting with '#' comments out the rest of the line.
+static bool split_words(const std::string& line, std::vector<std::string>* words) {
+  auto iter = line.begin();
+  for (;;) {
+    while (iter != line.end() && isspace(*iter)) iter++;
+    if (iter == line.end() || *iter == '#') return true;
+
+    std::string word;
+    while (iter != line.end() && !isspace(*iter)) {
+      if (*iter == '\'' || *iter == '"') {
+        const char quote = *iter++;
+        while (iter != line.end() && *iter != quote) word.push_back(*iter++);
+        if (iter == line.end()) return false;
+        iter++;
+      } else {
+        word.push_back(*iter++);
+      }
+    }
+    words->push_back(word);
+  }
+}
+
+static int Batch(PulseClient& ponymix, int argc, char* argv[]) {
+  const char* path = argc > 0 ? argv[0] : "-";
+  FILE* fp = stdin;
+  if (strcmp(path, "-") != 0) {
+    fp = fopen(path, "r");
+    if (fp == nullptr) err(1, "error: failed to open %s", path);
+  }
+
+  // Every command in the script works from the same snapshot, so fetch it
+  // all at once rather than piecemeal as each command needs it.
+  ponymix.PopulateMissing();
+
+  int status = 0;
+  char* line = nullptr;
+  size_t size = 0;
+  for (int lineno = 1; getline(&line, &size, fp) != -1; lineno++) {
+    std::vector<std::string> words;
+    if (!split_words(line, &words)) {
+      errx(1, "error: %s:%d: unterminated quote", path, lineno);
+    }
+    if (words.empty()) continue;
+
+    std::vector<char*> cmdline{ program_invocation_name };
+    for (std::string& word : words) cmdline.push_back(&word[0]);
+    cmdline.push_back(nullptr);
+
+    const int line_status = run_commands(ponymix, cmdline.size() - 1,
+                                         cmdline.data());
+    if (status == 0) status = line_status;
+  }
+  free(line);
+
+  if (fp != stdin) fclose(fp);
+  return status;
+}
+
 static bool endswith(const std::string& subject, const std::string& predicate) {
   if (subject.size() < predicate.size()) {
     return false;
@@ -409,9 +990,10 @@ static bool endswith(const std::string& subject, const std::string& predicate) {
       predicate.size(), predicate) == 0;
 }
 
-static const std::pair<const std::string, const Command>& string_to_command(
-    const char* str) {
-  static std::map<std::string, const Command> actionmap{
+typedef std::map<std::string, const Command> CommandMap;
+
+static const CommandMap& command_map() {
+  static const CommandMap actionmap{
     // command name            function         arg min  arg max
     { "defaults",            { ShowDefaults,        { 0, 0 } } },
     { "list",                { List,                { 0, 0 } } },
@@ -422,6 +1004,7 @@ static const std::pair<const std::string, const Command>& string_to_command(
     { "list-profiles-short", { ListProfiles,        { 0, 0 } } },
     { "get-volume",          { GetVolume,           { 0, 0 } } },
     { "set-volume",          { SetVolume,           { 1, 1 } } },
+    { "fade",                { FadeVolume,          { 1, 1 } } },
     { "get-balance",         { GetBalance,          { 0, 0 } } },
     { "set-balance",         { SetBalance,          { 1, 1 } } },
     { "adj-balance",         { AdjBalance,          { 1, 1 } } },
@@ -435,42 +1018,66 @@ static const std::pair<const std::string, const Command>& string_to_command(
     { "get-profile",         { GetProfile,          { 0, 0 } } },
     { "set-profile",         { SetProfile,          { 1, 1 } } },
     { "move",                { Move,                { 1, 1 } } },
+    { "move-all",            { MoveAll,             { 0, 0 } } },
     { "kill",                { Kill,                { 0, 0 } } },
     { "is-available",        { IsAvailable,         { 0, 0 } } },
+    { "daemon",              { Daemon,              { 0, 0 } } },
+    { "batch",               { Batch,               { 0, 1 } } },
+    { "watch",               { Watch,               { 0, 0 } } },
+    { "meter",               { Meter,               { 0, 0 } } },
   };
 
+  return actionmap;
+}
+
+static bool startswith(const std::string& subject, const char* prefix) {
+  return subject.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Find the command named str, or the only one whose name starts with it.
+// Returns the end of the map if there's no such command, setting ambiguous
+// if that's because there are several.
+static CommandMap::const_iterator find_command(const char* str,
+                                               bool* ambiguous) {
+  const CommandMap& actionmap = command_map();
+  *ambiguous = false;
+
   const auto match = actionmap.lower_bound(str);
-  if (match == actionmap.end()) {
-    errx(1, "error: Invalid action specified: %s", str);
+  if (match == actionmap.end() || !startswith(match->first, str)) {
+    return actionmap.end();
   }
 
   // Check for exact match
-  if (match->first == str) {
-    return *match;
-  }
+  if (match->first == str) return match;
 
   // Match on prefix, ensure only a single match
-  for (auto iter = match; iter != actionmap.end(); iter++) {
-    if (iter->first.find(str) != 0) {
-      if (iter == match) {
-        errx(1, "error: Invalid action specified: %s", str);
-      } else {
-        break;
-      }
-    }
-    if (iter != match) {
-      auto i = match;
-      std::string cand = i->first;
-      i++;
-      while (i->first.find(str) == 0) {
-        cand += ", " + i->first;
-        i++;
-      }
-      errx(1, "error: Ambiguous action specified: %s (%s)", str, cand.c_str());
-    }
+  const auto next = std::next(match);
+  if (next != actionmap.end() && startswith(next->first, str)) {
+    *ambiguous = true;
+    return actionmap.end();
   }
 
-  return *match;
+  return match;
+}
+
+const std::pair<const std::string, const Command>& string_to_command(
+    const char* str) {
+  Phase phase("resolve");
+  const CommandMap& actionmap = command_map();
+
+  bool ambiguous;
+  const auto match = find_command(str, &ambiguous);
+  if (match != actionmap.end()) return *match;
+
+  if (!ambiguous) errx(1, "error: Invalid action specified: %s", str);
+
+  std::string cand;
+  for (auto i = actionmap.lower_bound(str);
+       i != actionmap.end() && startswith(i->first, str); i++) {
+    if (!cand.empty()) cand += ", ";
+    cand += i->first;
+  }
+  errx(1, "error: Ambiguous action specified: %s (%s)", str, cand.c_str());
 }
 
 static void version() {
@@ -483,7 +1090,8 @@ static void version() {
 }
 
 static void usage() {
-  printf("usage: %s [options] <command>...\n", program_invocation_short_name);
+  printf("usage: %s [options] <command>... [\\; [options] <command>...]...\n",
+         program_invocation_short_name);
   fputs("\nOptions:\n"
         " -h, --help              display this help and exit\n"
         " -V, --version           display program version and exit\n\n"
@@ -491,9 +1099,27 @@ static void usage() {
         " -c, --card CARD         target card (index or name)\n"
         " -d, --device DEVICE     target device (index or name)\n"
         " -t, --devtype TYPE      device type\n"
+        "     --all               target every device of the type\n"
+        "     --match GLOB        target devices whose name matches GLOB\n"
+        "     --prop KEY=VALUE    target devices whose property KEY matches VALUE\n"
         " -N, --notify            use libnotify to announce volume changes\n"
+        "     --async             don't wait for changes to be applied\n"
+        "     --format FORMAT     output format for watch\n"
+        "     --window MS         gather changes for MS milliseconds when watching\n"
+        "                         or coalescing\n"
+        "     --coalesce          merge concurrent increase and decrease commands\n"
+        "     --remember          change a device named as last time without\n"
+        "                         looking it up first\n"
+        "     --move-streams      move all streams along with set-default\n"
+        "     --timings           print where the time went to stderr at exit\n"
+        "     --trace FILE        write a Chrome trace of the run to FILE\n"
+        "     --rate HZ           update the meter HZ times per second\n"
+        "     --raw               print meter levels as plain numbers\n"
+        "     --duration MS       take MS milliseconds to fade (default 500)\n"
+        "     --curve CURVE       fade evenly in percent (linear) or decibels (log)\n"
         "     --max-volume VALUE  use VALUE as max volume\n"
         "     --short             output brief (parseable) lists\n"
+        "     --output-format FMT print lists as text, json or ndjson\n"
         "     --source            alias to -t source\n"
         "     --input             alias to -t source\n"
         "     --sink              alias to -t sink\n"
@@ -509,6 +1135,7 @@ static void usage() {
         "  list-cards             list available cards\n"
         "  get-volume             get volume for device\n"
         "  set-volume VALUE       set volume for device\n"
+        "  fade VALUE             gradually set volume for device\n"
         "  get-balance            get balance for device\n"
         "  set-balance VALUE      set balance for device\n"
         "  adj-balance VALUE      increase or decrease balance for device\n"
@@ -518,9 +1145,12 @@ static void usage() {
         "  unmute                 unmute device\n"
         "  toggle                 toggle mute\n"
         "  is-muted               check if muted\n"
-        "  is-available           check if available\n", stdout);
+        "  is-available           check if available\n"
+        "  watch                  print volume and mute whenever they change\n"
+        "  meter                  show the peak level of a device as it plays\n", stdout);
   fputs("\nApplication Commands:\n"
         "  move DEVICE            move target device to DEVICE\n"
+        "  move-all               move all streams to the target device\n"
         "  kill DEVICE            kill target DEVICE\n", stdout);
 
   fputs("\nCard Commands:\n"
@@ -528,6 +1158,10 @@ static void usage() {
         "  get-profile            get active profile for card\n"
         "  set-profile PROFILE    set profile for a card\n", stdout);
 
+  fputs("\nOther Commands:\n"
+        "  batch [FILE]           run each line of FILE or stdin as a command\n"
+        "  daemon                 serve other invocations from a resident process\n", stdout);
+
   exit(EXIT_SUCCESS);
 }
 
@@ -562,30 +1196,59 @@ static int CommandDispatch(PulseClient& ponymix, int argc, char *argv[]) {
     opt_short = true;
   }
 
+  static const char* const selectable[] = {
+    "set-volume", "set-balance", "adj-balance", "increase", "decrease",
+    "mute", "unmute", "toggle", "move", "kill",
+  };
+  if (selecting() && std::find(std::begin(selectable), std::end(selectable),
+                               cmd.first) == std::end(selectable)) {
+    errx(1, "error: %s doesn't take --all, --match or --prop", cmd.first.c_str());
+  }
+
+  Phase phase("command");
+  phase.Describe(cmd.first);
   return cmd.second.fn(ponymix, argc, argv);
 }
 
-bool parse_options(int argc, char** argv) {
-  static const struct option opts[]{
-    { "card",           required_argument, 0, 'c' },
-    { "device",         required_argument, 0, 'd' },
-    { "help",           no_argument,       0, 'h' },
-    { "notify",         no_argument,       0, 'N' },
-    { "devtype",        required_argument, 0, 't' },
-    { "version",        no_argument,       0, 'V' },
-    { "sink",           no_argument,       0, 0x100 },
-    { "output",         no_argument,       0, 0x101 },
-    { "source",         no_argument,       0, 0x102 },
-    { "input",          no_argument,       0, 0x103 },
-    { "sink-input",     no_argument,       0, 0x104 },
-    { "source-output",  no_argument,       0, 0x105 },
-    { "max-volume",     required_argument, 0, 0x106 },
-    { "short",          no_argument,       0, 0x107 },
-    { 0, 0, 0, 0 },
-  };
+static const char kShortOptions[] = "c:d:hNt:V";
+
+static const struct option kLongOptions[]{
+  { "card",           required_argument, 0, 'c' },
+  { "device",         required_argument, 0, 'd' },
+  { "help",           no_argument,       0, 'h' },
+  { "notify",         no_argument,       0, 'N' },
+  { "devtype",        required_argument, 0, 't' },
+  { "version",        no_argument,       0, 'V' },
+  { "sink",           no_argument,       0, 0x100 },
+  { "output",         no_argument,       0, 0x101 },
+  { "source",         no_argument,       0, 0x102 },
+  { "input",          no_argument,       0, 0x103 },
+  { "sink-input",     no_argument,       0, 0x104 },
+  { "source-output",  no_argument,       0, 0x105 },
+  { "max-volume",     required_argument, 0, 0x106 },
+  { "short",          no_argument,       0, 0x107 },
+  { "async",          no_argument,       0, 0x108 },
+  { "format",         required_argument, 0, 0x109 },
+  { "window",         required_argument, 0, 0x10a },
+  { "rate",           required_argument, 0, 0x10b },
+  { "raw",            no_argument,       0, 0x10c },
+  { "duration",       required_argument, 0, 0x10d },
+  { "curve",          required_argument, 0, 0x10e },
+  { "coalesce",       no_argument,       0, 0x10f },
+  { "timings",        no_argument,       0, 0x110 },
+  { "trace",          required_argument, 0, 0x111 },
+  { "all",            no_argument,       0, 0x112 },
+  { "match",          required_argument, 0, 0x113 },
+  { "prop",           required_argument, 0, 0x114 },
+  { "move-streams",   no_argument,       0, 0x115 },
+  { "output-format",  required_argument, 0, 0x116 },
+  { "remember",       no_argument,       0, 0x117 },
+  { 0, 0, 0, 0 },
+};
 
+static bool parse_options(int argc, char** argv) {
   for (;;) {
-    int opt = getopt_long(argc, argv, "c:d:hNt:V", opts, nullptr);
+    int opt = getopt_long(argc, argv, kShortOptions, kLongOptions, nullptr);
     if (opt == -1)
       break;
 
@@ -637,6 +1300,93 @@ bool parse_options(int argc, char** argv) {
     case 0x107:
       opt_short = true;
       break;
+    case 0x108:
+      opt_async = true;
+      break;
+    case 0x109:
+      opt_format = optarg;
+      break;
+    case 0x10a:
+      if (xstrtol(optarg, &opt_window) < 0 || opt_window < 0) {
+        fprintf(stderr, "error: invalid window: %s: must be a non-negative integer\n",
+            optarg);
+        return false;
+      }
+      break;
+    case 0x10b:
+      if (xstrtol(optarg, &opt_rate) < 0 || opt_rate == 0 || opt_rate > 1000) {
+        fprintf(stderr, "error: invalid rate: %s: must be between 1 and 1000\n",
+            optarg);
+        return false;
+      }
+      break;
+    case 0x10c:
+      opt_raw = true;
+      break;
+    case 0x10d:
+      if (xstrtol(optarg, &opt_duration) < 0 || opt_duration < 0) {
+        fprintf(stderr, "error: invalid duration: %s: must be a non-negative integer\n",
+            optarg);
+        return false;
+      }
+      break;
+    case 0x10e:
+      if (strcmp(optarg, "linear") == 0) {
+        opt_curve = FadeCurve::LINEAR;
+      } else if (strcmp(optarg, "log") == 0) {
+        opt_curve = FadeCurve::LOG;
+      } else {
+        fprintf(stderr, "error: invalid curve: %s: must be linear or log\n",
+            optarg);
+        return false;
+      }
+      break;
+    case 0x10f:
+      opt_coalesce = true;
+      break;
+    case 0x110:
+      Timings::Enable();
+      break;
+    case 0x111:
+      if (!Timings::Trace(optarg)) {
+        fprintf(stderr, "error: failed to open trace file: %s: %s\n",
+            optarg, strerror(errno));
+        return false;
+      }
+      break;
+    case 0x112:
+      opt_all = true;
+      break;
+    case 0x113:
+      opt_match = optarg;
+      break;
+    case 0x114:
+      if (strchr(optarg, '=') == nullptr || *optarg == '=') {
+        fprintf(stderr, "error: invalid property: %s: must be KEY=VALUE\n",
+            optarg);
+        return false;
+      }
+      opt_props.push_back(optarg);
+      break;
+    case 0x115:
+      opt_move_streams = true;
+      break;
+    case 0x116:
+      if (strcmp(optarg, "text") == 0) {
+        opt_output = OutputFormat::TEXT;
+      } else if (strcmp(optarg, "json") == 0) {
+        opt_output = OutputFormat::JSON;
+      } else if (strcmp(optarg, "ndjson") == 0) {
+        opt_output = OutputFormat::NDJSON;
+      } else {
+        fprintf(stderr, "error: invalid output format: %s: must be text, json "
+            "or ndjson\n", optarg);
+        return false;
+      }
+      break;
+    case 0x117:
+      opt_remember = true;
+      break;
     default:
       return false;
     }
@@ -645,36 +1395,200 @@ bool parse_options(int argc, char** argv) {
   return true;
 }
 
-int main(int argc, char* argv[]) {
-  PulseClient ponymix("ponymix");
-  ponymix.Populate();
-
-  // defaults. intentionally, we don't set a card -- only get
-  // that on demand if a function needs it.
-  ServerInfo defaults = ponymix.GetDefaults();
-  opt_action = "defaults";
+// Reset all options to their defaults. Intentionally, we don't set a card
+// or device -- only get those on demand if a function needs them.
+static void reset_options() {
   opt_devtype = DeviceType::SINK;
+  opt_listrestrict = false;
+  opt_short = false;
+  opt_action = "defaults";
+  opt_device = nullptr;
+  opt_all = false;
+  opt_match = nullptr;
+  opt_props.clear();
+  opt_card = nullptr;
+  opt_notify = false;
+  opt_async = false;
+  opt_format = "%v %m";
+  opt_window = 50;
+  opt_rate = 25;
+  opt_raw = false;
+  opt_duration = 500;
+  opt_curve = FadeCurve::LINEAR;
+  opt_coalesce = false;
+  opt_remember = false;
+  opt_move_streams = false;
+  opt_output = OutputFormat::TEXT;
   opt_maxvolume = 100;
+}
 
-  if (!parse_options(argc, argv)) return 1;
-  argc -= optind;
-  argv += optind;
-
-  // Do this after parsing such that we respect any changes to opt_devtype and
-  // explicit opt_device
-  if (opt_device == nullptr)
-    opt_device = defaults.GetDefault(opt_devtype).c_str();
-
+// Run a command once its options are parsed.
+static int Execute(PulseClient& ponymix, int argc, char* argv[]) {
 #ifdef HAVE_NOTIFY
   if (opt_notify) {
-    ponymix.SetNotifier(std::make_unique<LibnotifyNotifier>());
+    // All commands share one notification, and whatever is still to be
+    // shown goes out as the process exits.
+    static std::shared_ptr<Notifier> notifier =
+        std::make_shared<LibnotifyNotifier>();
+    ponymix.SetNotifier(notifier);
   } else
 #endif
   {
     ponymix.SetNotifier(std::make_unique<CommandLineNotifier>());
   }
+  ponymix.SetAsync(opt_async);
 
   return CommandDispatch(ponymix, argc, argv);
 }
 
+// Split a command line into the commands separated by ";" arguments. Each
+// one gets its own copy of argv[0] and is terminated like argv itself.
+static std::vector<std::vector<char*>> split_command_line(int argc, char* argv[]) {
+  std::vector<std::vector<char*>> cmdlines;
+  std::vector<char*> cmdline{ argv[0] };
+  for (int i = 1; i <= argc; i++) {
+    if (i < argc && strcmp(argv[i], ";") != 0) {
+      cmdline.push_back(argv[i]);
+      continue;
+    }
+
+    // Skip empty commands, e.g. from a trailing ";", unless there's
+    // nothing else to run: no command at all means the default one.
+    if (cmdline.size() > 1 || (i == argc && cmdlines.empty())) {
+      cmdline.push_back(nullptr);
+      cmdlines.push_back(cmdline);
+    }
+    cmdline.resize(1);
+  }
+  return cmdlines;
+}
+
+bool ParseCommandOptions(int argc, char* argv[]) {
+  reset_options();
+  color = Color();
+
+  // Make getopt start over.
+  optind = 0;
+  return parse_options(argc, argv);
+}
+
+// Parse and run a single command with its own options.
+static int run_command(PulseClient& ponymix, int argc, char* argv[]) {
+  if (!ParseCommandOptions(argc, argv)) return 1;
+
+  return Execute(ponymix, argc - optind, argv + optind);
+}
+
+// Run each of the commands in a command line, returning the exit status
+// of the first one which failed, so that a later success can't hide it.
+static int run_commands(PulseClient& ponymix, int argc, char* argv[]) {
+  std::vector<std::vector<char*>> cmdlines = split_command_line(argc, argv);
+
+  // As for a batch script, fetch once for all commands.
+  if (cmdlines.size() > 1) ponymix.PopulateMissing();
+
+  int status = 0;
+  for (std::vector<char*>& cmdline : cmdlines) {
+    const int command_status =
+        run_command(ponymix, cmdline.size() - 1, cmdline.data());
+    if (status == 0) status = command_status;
+  }
+  return status;
+}
+
+int RunCommandLine(PulseClient& ponymix, int argc, char* argv[]) {
+  int status = run_commands(ponymix, argc, argv);
+
+  // Changes made in async mode may still be on their way.
+  if (!ponymix.Flush() && status == 0) status = 1;
+  return status;
+}
+
+// The long option name stands for, given as on the command line, without
+// its dashes or value: its full name or, as getopt_long allows, an
+// unambiguous prefix of it. Null if there's no such option.
+static const struct option* find_long_option(const std::string& name) {
+  const struct option* found = nullptr;
+  for (const struct option* o = kLongOptions; o->name != nullptr; o++) {
+    if (name == o->name) return o;
+    if (startswith(o->name, name.c_str())) {
+      if (found != nullptr) return nullptr;
+      found = o;
+    }
+  }
+  return found;
+}
+
+// Scan one command's words as getopt would parse them: options, which may
+// take the next word as their value, and then the action.
+static bool scan_command(const std::vector<char*>& cmdline,
+                         CommandLineScan* scan) {
+  // The words run from cmdline[1] to the terminating null.
+  const size_t end = cmdline.size() - 1;
+  const char* action = nullptr;
+  const char* asked = nullptr;
+
+  // help and version take over as soon as they're seen.
+  auto note = [&](int val) {
+    if (asked != nullptr) return;
+    if (val == 'h') asked = "help";
+    if (val == 'V') asked = "version";
+    if (val == 0x110 || val == 0x111) scan->timed = true;
+  };
+
+  for (size_t i = 1; i < end; i++) {
+    const char* word = cmdline[i];
+
+    if (strcmp(word, "--") == 0) {
+      if (action == nullptr && i + 1 < end) action = cmdline[i + 1];
+      break;
+    }
+
+    if (word[0] == '-' && word[1] == '-') {
+      const char* value = strchr(word + 2, '=');
+      const struct option* opt = find_long_option(
+          value ? std::string(word + 2, value) : std::string(word + 2));
+      if (opt == nullptr) return false;
+      if (opt->has_arg == required_argument && value == nullptr && ++i == end) {
+        return false;
+      }
+      note(opt->val);
+    } else if (word[0] == '-' && word[1] != '\0') {
+      // Short options may be bunched together. One which takes a value
+      // has the rest of the word, or the next word, as its value.
+      for (const char* c = word + 1; *c != '\0'; c++) {
+        const char* spec = *c == ':' ? nullptr : strchr(kShortOptions, *c);
+        if (spec == nullptr) return false;
+        note(*c);
+        if (spec[1] == ':') {
+          if (c[1] == '\0' && ++i == end) return false;
+          break;
+        }
+      }
+    } else if (action == nullptr) {
+      action = word;
+    }
+  }
+
+  if (asked == nullptr) asked = action ? action : "defaults";
+  if (strcmp(asked, "help") == 0 || strcmp(asked, "version") == 0) {
+    scan->commands.push_back(asked);
+    return true;
+  }
+
+  bool ambiguous;
+  const auto command = find_command(asked, &ambiguous);
+  if (command == command_map().end()) return false;
+
+  scan->commands.push_back(command->first);
+  return true;
+}
+
+bool ScanCommandLine(int argc, char* argv[], CommandLineScan* scan) {
+  for (const std::vector<char*>& cmdline : split_command_line(argc, argv)) {
+    if (!scan_command(cmdline, scan)) return false;
+  }
+  return true;
+}
+
 // vim: set et ts=2 sw=2:
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "json.h"
+#include "pulse.h"
+
+// C++
+#include <string>
+#include <utility>
+#include <vector>
+
+// ponymix's commands and options: all of the command line but main(),
+// which is kept apart in main.cc so that the benchmarks can link against
+// the rest.
+
+struct Command {
+  int (*fn)(PulseClient&, int, char*[]);
+  Range<int> args;
+};
+
+// Look up a command by its name or an unambiguous prefix of it, exiting
+// with an error if there's no such command.
+const std::pair<const std::string, const Command>& string_to_command(
+    const char* str);
+
+// Reset the options to their defaults, then parse a command's own, as is
+// done before running it. Returns false if they're invalid.
+bool ParseCommandOptions(int argc, char* argv[]);
+
+// Print a device or card as the list commands do, or write it out as JSON,
+// according to the options last parsed.
+void Print(const Device& device);
+void Print(const Card& card);
+void Write(JsonWriter& json, const Device& device);
+void Write(JsonWriter& json, const Card& card);
+
+// Parse and run a complete command line, possibly made up of several
+// commands, e.g. on behalf of a daemon client.
+int RunCommandLine(PulseClient& ponymix, int argc, char* argv[]);
+
+// What a command line asks for, as far as a look at its words can tell,
+// without parsing its options for real or acting on any of them.
+struct CommandLineScan {
+  // The full name of each command, or "help" or "version" where one of
+  // those is asked for instead.
+  std::vector<std::string> commands;
+
+  // Whether --timings or --trace is given.
+  bool timed = false;
+};
+
+// Scan a command line. Returns false if any of it isn't understood, e.g.
+// an unknown option or command; that's reported when it's run for real.
+bool ScanCommandLine(int argc, char* argv[], CommandLineScan* scan);
+
+// vim: set et ts=2 sw=2:
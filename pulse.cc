@@ -1,16 +1,36 @@
 // Self
 #include "pulse.h"
 
+#include "timings.h"
+
 // C
 #include <err.h>
+#include <fnmatch.h>
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 // C++
 #include <algorithm>
 #include <stdexcept>
 
+const char* const kMatchProps[] = {
+  PA_PROP_APPLICATION_PROCESS_BINARY,
+  PA_PROP_MEDIA_NAME,
+  PA_PROP_DEVICE_PRODUCT_NAME,
+};
+
+const size_t kMaxMatchProps = sizeof(kMatchProps) / sizeof(kMatchProps[0]);
+
+pa_cvolume* value_to_cvol(long value, pa_cvolume *cvol) {
+  return pa_cvolume_scale(cvol, std::max(value * PA_VOLUME_NORM / 100.0, 0.0));
+}
+
+int volume_as_percent(const pa_cvolume* cvol) {
+  return round(pa_cvolume_max(cvol) * 100.0 / PA_VOLUME_NORM);
+}
+
 namespace {
 void connect_state_cb(pa_context* context, void* raw) {
   auto state = static_cast<enum pa_context_state*>(raw);
@@ -27,6 +47,12 @@ void success_cb(pa_context* context, int success, void* raw) {
   }
 }
 
+// What a reply carrying info is called in a trace.
+const char* info_event(const pa_sink_info*) { return "sink info"; }
+const char* info_event(const pa_source_info*) { return "source info"; }
+const char* info_event(const pa_sink_input_info*) { return "sink-input info"; }
+const char* info_event(const pa_source_output_info*) { return "source-output info"; }
+
 void card_info_cb(pa_context* context,
                          const pa_card_info* info,
                          int eol,
@@ -38,8 +64,9 @@ void card_info_cb(pa_context* context,
   }
 
   if (!eol) {
-    auto cards = static_cast<std::vector<Card>*>(raw);
-    cards->push_back(info);
+    Timings::Instant("card info", info->index);
+    auto cards = static_cast<Collection<Card>*>(raw);
+    cards->Put(info);
   }
 }
 
@@ -52,24 +79,227 @@ void device_info_cb(pa_context* context, const T* info, int eol, void* raw) {
   }
 
   if (!eol) {
+    Timings::Instant(info_event(info), info->index);
+    auto devices = static_cast<Collection<Device>*>(raw);
+    devices->Put(info);
+  }
+}
+
+// A fetch of every device of a type, noting which have the given
+// properties.
+struct PropertyMatch {
+  Collection<Device>* devices;
+  const std::vector<const char*>* props;
+  std::vector<uint32_t> matched;
+};
+
+// Whether a proplist has each KEY=VALUE in props, where VALUE is a glob.
+bool has_props(const pa_proplist* proplist,
+               const std::vector<const char*>& props) {
+  for (const char* prop : props) {
+    const char* value = strchr(prop, '=');
+    const std::string key(prop, value++);
+    const char* actual = pa_proplist_gets(proplist, key.c_str());
+    if (actual == nullptr || fnmatch(value, actual, 0) != 0) return false;
+  }
+  return true;
+}
+
+template<typename T>
+void property_match_cb(pa_context* context, const T* info, int eol, void* raw) {
+  auto match = static_cast<PropertyMatch*>(raw);
+  device_info_cb(context, info, eol, match->devices);
+  if (eol == 0 && has_props(info->proplist, *match->props)) {
+    match->matched.push_back(info->index);
+  }
+}
+
+// Like device_info_cb, but for a lookup of a single device. A failed lookup
+// only means that no such device exists, which the caller reports.
+template<typename T>
+void single_device_info_cb(pa_context* context __attribute__((unused)),
+                           const T* info, int eol, void* raw) {
+  if (eol == 0) {
     auto devices = static_cast<std::vector<Device>*>(raw);
     devices->push_back(info);
   }
 }
 
+// Applies the result of a refresh triggered by a subscription event. The
+// device may have vanished again in the meantime, in which case its removal
+// event is on its way and there's nothing to do.
+template<typename T>
+void device_update_cb(pa_context* context __attribute__((unused)),
+                      const T* info, int eol, void* raw) {
+  if (eol != 0) return;
+
+  auto devices = static_cast<Collection<Device>*>(raw);
+  devices->Put(info);
+}
+
+void card_update_cb(pa_context* context __attribute__((unused)),
+                    const pa_card_info* info, int eol, void* raw) {
+  if (eol != 0) return;
+
+  auto cards = static_cast<Collection<Card>*>(raw);
+  cards->Put(info);
+}
+
+// Once the connection is up, losing it means our state can no longer be
+// kept current.
+void context_lost_cb(pa_context* context, void* raw) {
+  switch (pa_context_get_state(context)) {
+  case PA_CONTEXT_FAILED:
+  case PA_CONTEXT_TERMINATED: {
+    fprintf(stderr, "lost connection to pulse daemon: %s\n",
+        pa_strerror(pa_context_errno(context)));
+    auto api = static_cast<pa_mainloop_api*>(raw);
+    api->quit(api, 1);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
 void server_info_cb(pa_context* context __attribute__((unused)),
                     const pa_server_info* i, void* raw) {
   auto defaults = static_cast<ServerInfo*>(raw);
   defaults->sink = i->default_sink_name;
   defaults->source = i->default_source_name;
+  defaults->cookie = i->cookie;
 }
 
-pa_cvolume* value_to_cvol(long value, pa_cvolume *cvol) {
-  return pa_cvolume_scale(cvol, std::max(value * PA_VOLUME_NORM / 100.0, 0.0));
+// Fill props with the values of kMatchProps, in order, with an empty string
+// for any which isn't set. They point into proplist.
+void match_props(const pa_proplist* proplist,
+                 const char* props[kMaxMatchProps]) {
+  for (size_t i = 0; i < kMaxMatchProps; i++) {
+    props[i] = pa_proplist_gets(proplist, kMatchProps[i]);
+    if (props[i] == nullptr) props[i] = "";
+  }
 }
 
-int volume_as_percent(const pa_cvolume* cvol) {
-  return round(pa_cvolume_max(cvol) * 100.0 / PA_VOLUME_NORM);
+// The operations for each type of device, in the order of DeviceType.
+const Operations kDeviceOperations[] = {
+  {
+    pa_context_set_sink_mute_by_index,
+    pa_context_set_sink_volume_by_index,
+    pa_context_set_default_sink,
+    nullptr,
+    nullptr,
+    pa_context_set_sink_mute_by_name,
+    pa_context_set_sink_volume_by_name,
+  },
+  {
+    pa_context_set_source_mute_by_index,
+    pa_context_set_source_volume_by_index,
+    pa_context_set_default_source,
+    nullptr,
+    nullptr,
+    pa_context_set_source_mute_by_name,
+    pa_context_set_source_volume_by_name,
+  },
+  {
+    pa_context_set_sink_input_mute,
+    pa_context_set_sink_input_volume,
+    nullptr,
+    pa_context_kill_sink_input,
+    pa_context_move_sink_input_by_index,
+    nullptr,
+    nullptr,
+  },
+  {
+    pa_context_set_source_output_mute,
+    pa_context_set_source_output_volume,
+    nullptr,
+    pa_context_kill_source_output,
+    pa_context_move_source_output_by_index,
+    nullptr,
+    nullptr,
+  },
+};
+
+const Operations* device_operations(DeviceType type) {
+  return &kDeviceOperations[static_cast<int>(type)];
+}
+
+// Time between the steps of a fade.
+const pa_usec_t kFadeStepUsec = 20 * PA_USEC_PER_MSEC;
+
+// Silence is infinitely quiet in decibels, so logarithmic fades to or from
+// silence start or end here instead.
+const double kFadeFloorDb = -60.0;
+
+// The volume a fade has reached at progress, from 0 to 1.
+pa_volume_t fade_volume(pa_volume_t from, pa_volume_t to, double progress,
+                        FadeCurve curve) {
+  if (progress <= 0.0) return from;
+  if (progress >= 1.0) return to;
+
+  if (curve == FadeCurve::LOG) {
+    const double from_db = std::max(pa_sw_volume_to_dB(from), kFadeFloorDb);
+    const double to_db = std::max(pa_sw_volume_to_dB(to), kFadeFloorDb);
+    return pa_sw_volume_from_dB(from_db + (to_db - from_db) * progress);
+  }
+
+  return lround(from + (static_cast<double>(to) - from) * progress);
+}
+
+// The loudest of a run of samples. Eight samples are compared at a time
+// as a vector, which the compiler maps onto SIMD instructions.
+float peak_level(const float* samples, size_t count) {
+  typedef float v8sf __attribute__((vector_size(32)));
+  typedef int32_t v8si __attribute__((vector_size(32)));
+
+  v8sf peaks = {};
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    v8sf v;
+    memcpy(&v, samples + i, sizeof(v));
+    v = (v8sf)((v8si)v & 0x7fffffff);
+    peaks = v > peaks ? v : peaks;
+  }
+
+  float peak = 0;
+  for (int lane = 0; lane < 8; lane++) peak = std::max(peak, peaks[lane]);
+  for (; i < count; i++) peak = std::max(peak, fabsf(samples[i]));
+  return peak;
+}
+
+// Packs three bytes of text into a key for the substring index.
+uint32_t trigram(const char* text) {
+  return static_cast<unsigned char>(text[0]) << 16 |
+         static_cast<unsigned char>(text[1]) << 8 |
+         static_cast<unsigned char>(text[2]);
+}
+
+// The collections in a populate mask, for timings. names follows the order
+// of PulseClient's PopulateMask bits.
+std::string populate_names(unsigned mask) {
+  static const char* const names[] = {
+    "server-info", "sinks", "sources", "sink-inputs", "source-outputs", "cards",
+  };
+
+  std::string joined;
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (!(mask & (1u << i))) continue;
+    if (!joined.empty()) joined += ",";
+    joined += names[i];
+  }
+  return joined;
+}
+
+// The names the server resolves to the current default sink or source.
+const char* default_device_alias(DeviceType type) {
+  switch (type) {
+  case DeviceType::SINK:
+    return "@DEFAULT_SINK@";
+  case DeviceType::SOURCE:
+    return "@DEFAULT_SOURCE@";
+  default:
+    return nullptr;
+  }
 }
 
 int xstrtol(const char *str, long *out) {
@@ -91,10 +321,32 @@ PulseClient::PulseClient(std::string client_name) :
     volume_range_(0, 150),
     balance_range_(-100, 100),
     notifier_(new NullNotifier) {
+}
+
+//
+// Pulse Client
+//
+PulseClient::~PulseClient() {
+  if (context_ == nullptr) return;
+
+  Flush();
+  if (peak_stream_ != nullptr) pa_stream_unref(peak_stream_);
+
+  pa_context_unref(context_);
+  pa_mainloop_free(mainloop_);
+}
+
+pa_context* PulseClient::context() {
+  if (context_ == nullptr) connect();
+  return context_;
+}
+
+void PulseClient::connect() {
+  Phase phase("connect");
   enum pa_context_state state = PA_CONTEXT_CONNECTING;
 
   pa_proplist* proplist = pa_proplist_new();
-  pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, client_name.c_str());
+  pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, client_name_.c_str());
   pa_proplist_sets(proplist, PA_PROP_APPLICATION_ID, "com.falconindy.ponymix");
   pa_proplist_sets(proplist, PA_PROP_APPLICATION_VERSION, PONYMIX_VERSION);
   pa_proplist_sets(proplist, PA_PROP_APPLICATION_ICON_NAME, "audio-card");
@@ -108,6 +360,7 @@ PulseClient::PulseClient(std::string client_name) :
   pa_context_set_state_callback(context_, connect_state_cb, &state);
   pa_context_connect(context_, nullptr, PA_CONTEXT_NOFLAGS, nullptr);
   while (state != PA_CONTEXT_READY && state != PA_CONTEXT_FAILED) {
+    Timings::Count("mainloop iterations");
     pa_mainloop_iterate(mainloop_, 1, nullptr);
   }
 
@@ -116,28 +369,497 @@ PulseClient::PulseClient(std::string client_name) :
         pa_strerror(pa_context_errno(context_)));
     exit(EXIT_FAILURE);
   }
+
+  // state is about to go out of scope.
+  pa_context_set_state_callback(context_, nullptr, nullptr);
 }
 
-//
-// Pulse Client
-//
-PulseClient::~PulseClient() {
-  pa_context_unref(context_);
-  pa_mainloop_free(mainloop_);
+void PulseClient::DropConnection() {
+  // Deliberately leaked: tearing these down could write to a socket which
+  // is still shared with another process.
+  context_ = nullptr;
+  mainloop_ = nullptr;
+}
+
+pa_mainloop_api* PulseClient::MainloopApi() {
+  context();
+  return pa_mainloop_get_api(mainloop_);
+}
+
+int PulseClient::Run() {
+  int r = 0;
+  context();
+  pa_mainloop_run(mainloop_, &r);
+  return r;
+}
+
+void PulseClient::Subscribe() {
+  pa_context_set_state_callback(context(), context_lost_cb, MainloopApi());
+  pa_context_set_subscribe_callback(context(), subscribe_cb, this);
+
+  int success;
+  WaitOperationComplete(pa_context_subscribe(
+        context(),
+        static_cast<pa_subscription_mask_t>(PA_SUBSCRIPTION_MASK_SINK |
+                                            PA_SUBSCRIPTION_MASK_SOURCE |
+                                            PA_SUBSCRIPTION_MASK_SINK_INPUT |
+                                            PA_SUBSCRIPTION_MASK_SOURCE_OUTPUT |
+                                            PA_SUBSCRIPTION_MASK_SERVER |
+                                            PA_SUBSCRIPTION_MASK_CARD),
+        success_cb, &success));
+  if (!success) exit(EXIT_FAILURE);
+}
+
+void PulseClient::subscribe_cb(pa_context* context __attribute__((unused)),
+                               pa_subscription_event_type_t type,
+                               uint32_t index,
+                               void* raw) {
+  static_cast<PulseClient*>(raw)->handle_event(type, index);
+}
+
+void PulseClient::SetChangeCallback(std::function<void()> callback,
+                                    int window_ms) {
+  change_callback_ = std::move(callback);
+  change_window_ = window_ms * PA_USEC_PER_MSEC;
+}
+
+void PulseClient::handle_event(pa_subscription_event_type_t type,
+                               uint32_t index) {
+  unsigned facility = type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+
+  if (fetching_ & facility_mask(facility)) {
+    deferred_events_.emplace_back(type, index);
+    return;
+  }
+
+  // Only the last event for each object in a window matters.
+  if (change_callback_) {
+    queued_events_[{ facility, index }] = type;
+    if (change_timer_ == nullptr) {
+      struct timeval tv;
+      pa_mainloop_api* api = MainloopApi();
+      change_timer_ = api->time_new(
+          api, pa_timeval_rtstore(&tv, pa_rtclock_now() + change_window_, true),
+          change_timer_cb, this);
+    }
+    return;
+  }
+
+  // Replies to the queries below are applied as they arrive. Nothing waits
+  // on them, so the operations can be released right away.
+  pa_operation* op = apply_event(type, index);
+  if (op != nullptr) pa_operation_unref(op);
+}
+
+void PulseClient::change_timer_cb(pa_mainloop_api* api,
+                                  pa_time_event* event,
+                                  const struct timeval* tv __attribute__((unused)),
+                                  void* raw) {
+  auto client = static_cast<PulseClient*>(raw);
+  api->time_free(event);
+  client->change_timer_ = nullptr;
+  client->apply_queued_events();
+}
+
+void PulseClient::refresh_state_cb(pa_operation* op, void* raw) {
+  if (pa_operation_get_state(op) == PA_OPERATION_RUNNING) return;
+
+  auto client = static_cast<PulseClient*>(raw);
+  if (--client->refreshing_ == 0) client->change_callback_();
+}
+
+void PulseClient::apply_queued_events() {
+  auto events = std::move(queued_events_);
+  queued_events_.clear();
+
+  for (const auto& event : events) {
+    pa_operation* op = apply_event(event.second, event.first.second);
+    if (op == nullptr) continue;
+
+    refreshing_++;
+    pa_operation_set_state_callback(op, refresh_state_cb, this);
+    pa_operation_unref(op);
+  }
+
+  // Otherwise the last refresh to finish reports the changes.
+  if (refreshing_ == 0) change_callback_();
+}
+
+pa_operation* PulseClient::apply_event(pa_subscription_event_type_t type,
+                                       uint32_t index) {
+  unsigned facility = type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+  bool removed = (type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) ==
+      PA_SUBSCRIPTION_EVENT_REMOVE;
+  pa_operation* op = nullptr;
+
+  switch (facility) {
+  case PA_SUBSCRIPTION_EVENT_SERVER:
+    if (populated_ & POPULATE_SERVER_INFO) {
+      op = pa_context_get_server_info(context(), server_info_cb, &defaults_);
+    }
+    break;
+  case PA_SUBSCRIPTION_EVENT_CARD:
+    if (!(populated_ & POPULATE_CARDS)) break;
+    if (removed) {
+      cards_.Remove(index);
+    } else {
+      op = pa_context_get_card_info_by_index(
+          context(), index, card_update_cb, static_cast<void*>(&cards_));
+    }
+    break;
+  case PA_SUBSCRIPTION_EVENT_SINK:
+    op = refresh_device(DeviceType::SINK, index, removed);
+    break;
+  case PA_SUBSCRIPTION_EVENT_SOURCE:
+    op = refresh_device(DeviceType::SOURCE, index, removed);
+    break;
+  case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+    op = refresh_device(DeviceType::SINK_INPUT, index, removed);
+    break;
+  case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
+    op = refresh_device(DeviceType::SOURCE_OUTPUT, index, removed);
+    break;
+  }
+
+  return op;
+}
+
+pa_operation* PulseClient::refresh_device(DeviceType type,
+                                          const uint32_t index,
+                                          bool removed) {
+  // Collections which were never fetched are fetched in full on first use.
+  if (!(populated_ & populate_mask(type))) return nullptr;
+
+  if (removed) {
+    remove_device(type, index);
+    return nullptr;
+  }
+
+  return fetch_device_async(type, index);
+}
+
+pa_operation* PulseClient::fetch_device_async(DeviceType type,
+                                              const uint32_t index) {
+  void* raw = static_cast<void*>(&device_list(type));
+
+  switch (type) {
+  case DeviceType::SINK:
+    return pa_context_get_sink_info_by_index(
+        context(), index, device_update_cb, raw);
+  case DeviceType::SOURCE:
+    return pa_context_get_source_info_by_index(
+        context(), index, device_update_cb, raw);
+  case DeviceType::SINK_INPUT:
+    return pa_context_get_sink_input_info(
+        context(), index, device_update_cb, raw);
+  case DeviceType::SOURCE_OUTPUT:
+    return pa_context_get_source_output_info(
+        context(), index, device_update_cb, raw);
+  }
+
+  throw unreachable();
 }
 
 void PulseClient::Populate() {
-  populate_server_info();
-  populate_sinks();
-  populate_sources();
-  populate_cards();
+  populated_ = 0;
+  ensure_populated(POPULATE_ALL);
 }
 
-Card* PulseClient::GetCard(const uint32_t index) {
-  for (Card& card : cards_) {
-    if (card.index_ == index) return &card;
+void PulseClient::PopulateMissing() {
+  ensure_populated(POPULATE_ALL);
+}
+
+void PulseClient::PopulateDevices() {
+  ensure_populated(POPULATE_SINKS | POPULATE_SINK_INPUTS |
+                   POPULATE_SOURCES | POPULATE_SOURCE_OUTPUTS);
+}
+
+void PulseClient::BuildSearchIndex() {
+  sinks_.BuildIndex();
+  sources_.BuildIndex();
+  sink_inputs_.BuildIndex();
+  source_outputs_.BuildIndex();
+  cards_.BuildIndex();
+}
+
+struct Device::Record {
+  uint8_t type;
+  uint8_t channels;
+  uint8_t available;
+  uint8_t mute;
+  uint32_t index;
+  uint32_t name_at;
+  uint32_t desc_at;
+  uint32_t props_at;
+  uint32_t card_idx;
+  uint32_t monitor_idx;
+  uint32_t owner_idx;
+  int32_t volume_percent;
+  int32_t balance;
+  uint32_t packed_size;
+
+  // Whether packed, the block it describes, can be read safely: the
+  // channel count fits a pa_cvolume, every offset falls within the block,
+  // and its last string is terminated.
+  bool Valid(const char* packed) const {
+    return type <= static_cast<uint8_t>(DeviceType::SOURCE_OUTPUT) &&
+           available <= static_cast<uint8_t>(Availability::YES) &&
+           channels != 0 && channels <= PA_CHANNELS_MAX &&
+           channels * (sizeof(pa_volume_t) + 1) <= name_at &&
+           name_at < desc_at && desc_at < props_at &&
+           props_at <= packed_size && packed[packed_size - 1] == '\0';
   }
-  return nullptr;
+};
+
+namespace {
+
+void save_string(const std::string& str, std::string* out) {
+  const uint32_t size = str.size();
+  out->append(reinterpret_cast<const char*>(&size), sizeof(size));
+  out->append(str);
+}
+
+bool load_string(const char** data, const char* end, std::string* str) {
+  uint32_t size;
+  if (end - *data < static_cast<ptrdiff_t>(sizeof(size))) return false;
+  memcpy(&size, *data, sizeof(size));
+  *data += sizeof(size);
+
+  if (static_cast<size_t>(end - *data) < size) return false;
+  str->assign(*data, size);
+  *data += size;
+  return true;
+}
+
+// Holds notifications back until it's known that the change they're for
+// landed on the right device.
+class DeferredNotifier : public Notifier {
+ public:
+  virtual ~DeferredNotifier() {}
+
+  virtual void Notify(NotificationType type, long value, bool mute) const {
+    notifications_.push_back({ type, value, mute });
+  }
+
+  void Replay(const Notifier& notifier) const {
+    for (const Notification& notification : notifications_) {
+      notifier.Notify(notification.type, notification.value, notification.mute);
+    }
+  }
+
+ private:
+  struct Notification {
+    NotificationType type;
+    long value;
+    bool mute;
+  };
+
+  mutable std::vector<Notification> notifications_;
+};
+
+}  // namespace
+
+std::string PulseClient::SaveSnapshot() {
+  std::string snapshot;
+  save_string(defaults_.sink, &snapshot);
+  save_string(defaults_.source, &snapshot);
+  snapshot.append(reinterpret_cast<const char*>(&defaults_.cookie),
+                  sizeof(defaults_.cookie));
+
+  for (const Collection<Device>* devices :
+       { &sinks_, &sources_, &sink_inputs_, &source_outputs_ }) {
+    for (const Device& device : devices->Items()) device.save(&snapshot);
+  }
+  return snapshot;
+}
+
+bool PulseClient::LoadSnapshot(const std::string& snapshot) {
+  const char* data = snapshot.data();
+  const char* end = data + snapshot.size();
+
+  ServerInfo defaults;
+  if (!load_string(&data, end, &defaults.sink) ||
+      !load_string(&data, end, &defaults.source) ||
+      static_cast<size_t>(end - data) < sizeof(defaults.cookie)) {
+    return false;
+  }
+  memcpy(&defaults.cookie, data, sizeof(defaults.cookie));
+  data += sizeof(defaults.cookie);
+
+  std::vector<Device> devices;
+  while (data != end) {
+    Device::Record record;
+    if (static_cast<size_t>(end - data) < sizeof(record)) return false;
+    memcpy(&record, data, sizeof(record));
+    data += sizeof(record);
+
+    if (static_cast<size_t>(end - data) < record.packed_size) return false;
+
+    // A device which can't be read, e.g. one with no channels, is left out
+    // rather than costing the rest of the snapshot.
+    if (record.Valid(data)) devices.push_back(Device(record, data));
+    data += record.packed_size;
+  }
+
+  const unsigned mask = POPULATE_SERVER_INFO | POPULATE_SINKS |
+      POPULATE_SOURCES | POPULATE_SINK_INPUTS | POPULATE_SOURCE_OUTPUTS;
+  for (DeviceType type : { DeviceType::SINK, DeviceType::SOURCE,
+                           DeviceType::SINK_INPUT, DeviceType::SOURCE_OUTPUT }) {
+    device_list(type).Clear();
+  }
+  for (Device& device : devices) device_list(device.type_).Put(std::move(device));
+  defaults_ = std::move(defaults);
+  populated_ |= mask;
+
+  return true;
+}
+
+std::string PulseClient::RememberDevice(const Device& device) {
+  std::string memo;
+  device.save(&memo);
+  return memo;
+}
+
+PulseClient::ChangeResult PulseClient::ChangeRemembered(
+    std::string* memo, const std::string& selector,
+    const std::function<bool(Device&)>& change) {
+  Device::Record record;
+  if (memo->size() < sizeof(record)) return ChangeResult::STALE;
+  memcpy(&record, memo->data(), sizeof(record));
+
+  const char* packed = memo->data() + sizeof(record);
+  if (memo->size() - sizeof(record) != record.packed_size ||
+      !record.Valid(packed)) {
+    return ChangeResult::STALE;
+  }
+
+  // Only a device remembered by its own name can be changed by it, and
+  // what's already known here is better used as it is.
+  const Device remembered(record, packed);
+  const DeviceType type = remembered.type_;
+  const uint32_t index = remembered.index_;
+  Collection<Device>& devices = device_list(type);
+  if (selector != remembered.Name() || remembered.ops_->MuteByName == nullptr ||
+      async_ || (populated_ & populate_mask(type)) ||
+      devices.Get(index) != nullptr || devices.Get(selector) != nullptr) {
+    return ChangeResult::STALE;
+  }
+
+  // The reply to this describes the device as it was just before the
+  // change.
+  std::vector<Device> found;
+  pa_operation* query = query_device(type, 0, selector.c_str(), &found);
+
+  // Send the change without waiting, to a stand-in which takes its effect.
+  auto notifications = std::make_shared<DeferredNotifier>();
+  std::shared_ptr<Notifier> notifier = notifier_;
+  notifier_ = notifications;
+  async_ = true;
+  by_name_ = true;
+  bool success = change(devices.Put(remembered));
+  by_name_ = false;
+  async_ = false;
+  notifier_ = notifier;
+
+  std::vector<Operation*> operations;
+  operations.swap(pending_);
+  for (Operation* operation : operations) operation->quiet = true;
+
+  WaitOperationComplete(query);
+  int error = 0;
+  for (Operation* operation : operations) {
+    WaitOperationComplete(operation->op);
+    if (!operation->success) {
+      success = false;
+      error = operation->error;
+    }
+    delete operation;
+  }
+
+  const Device changed = *devices.Get(index);
+  devices.Remove(index);
+
+  // With no device by that name, the change went nowhere.
+  if (found.empty()) return ChangeResult::STALE;
+
+  const pa_cvolume volume = found[0].volume();
+  const pa_cvolume volume_remembered = remembered.volume();
+  const pa_channel_map channels = found[0].channel_map();
+  const pa_channel_map channels_remembered = remembered.channel_map();
+  const bool same = found[0].mute_ == remembered.mute_ &&
+      pa_cvolume_equal(&volume, &volume_remembered) &&
+      pa_channel_map_equal(&channels, &channels_remembered);
+  Device& device = devices.Put(std::move(found[0]));
+
+  if (!same) {
+    // The change was worked out from a stale copy of the device. Work it
+    // out again from how the device was just before, and send the result
+    // in its place, as looking the device up first would have.
+    if (!change(device)) return ChangeResult::FAILED;
+    *memo = RememberDevice(device);
+    return ChangeResult::CHANGED;
+  }
+
+  // Keep the device as the server described it, with the change on top.
+  device.update_volume(changed.volume());
+  device.mute_ = changed.mute_;
+
+  if (!success) {
+    if (error != 0) {
+      fprintf(stderr, "operation failed: %s\n", pa_strerror(error));
+    }
+    return ChangeResult::FAILED;
+  }
+
+  notifications->Replay(*notifier_);
+  *memo = RememberDevice(device);
+  return ChangeResult::CHANGED;
+}
+
+void PulseClient::ensure_populated(unsigned mask) {
+  mask &= ~populated_;
+  if (mask == 0) return;
+
+  Phase phase("populate");
+  if (Timings::enabled()) phase.Describe(populate_names(mask));
+
+  // Send every request before waiting on any of them. The replies arrive
+  // back to back, so this costs one round trip no matter how many
+  // collections are fetched.
+  std::vector<pa_operation*> ops;
+  if (mask & POPULATE_SERVER_INFO) ops.push_back(populate_server_info());
+  if (mask & POPULATE_SINKS) ops.push_back(populate_sinks());
+  if (mask & POPULATE_SINK_INPUTS) ops.push_back(populate_sink_inputs());
+  if (mask & POPULATE_SOURCES) ops.push_back(populate_sources());
+  if (mask & POPULATE_SOURCE_OUTPUTS) ops.push_back(populate_source_outputs());
+  if (mask & POPULATE_CARDS) ops.push_back(populate_cards());
+
+  finish_populate(mask, ops);
+}
+
+void PulseClient::finish_populate(unsigned mask,
+                                  const std::vector<pa_operation*>& ops) {
+  fetching_ |= mask;
+  WaitOperationComplete(ops);
+  fetching_ &= ~mask;
+  populated_ |= mask;
+
+  if (mask & POPULATE_SINKS) sinks_.EndRefresh();
+  if (mask & POPULATE_SINK_INPUTS) sink_inputs_.EndRefresh();
+  if (mask & POPULATE_SOURCES) sources_.EndRefresh();
+  if (mask & POPULATE_SOURCE_OUTPUTS) source_outputs_.EndRefresh();
+  if (mask & POPULATE_CARDS) cards_.EndRefresh();
+
+  // Events which arrived while waiting may or may not be reflected in the
+  // replies. Refreshing again is harmless either way.
+  std::vector<std::pair<pa_subscription_event_type_t, uint32_t>> events;
+  events.swap(deferred_events_);
+  for (const auto& event : events) handle_event(event.first, event.second);
+}
+
+Card* PulseClient::GetCard(const uint32_t index) {
+  ensure_populated(POPULATE_CARDS);
+  return cards_.Get(index);
 }
 
 Card* PulseClient::GetCard(const std::string& name) {
@@ -145,34 +867,149 @@ Card* PulseClient::GetCard(const std::string& name) {
   if (xstrtol(name.c_str(), &val) == 0) {
     return GetCard(val);
   } else {
-    return find_fuzzy(cards_, name);
+    ensure_populated(POPULATE_CARDS);
+    Card* card = cards_.Get(name);
+    return card != nullptr ? card : find_fuzzy(cards_, name);
   }
 }
 
 Card* PulseClient::GetCard(const Device& device) {
-  for (Card& card : cards_) {
-    if (device.card_idx_ == card.index_) return &card;
-  }
-  return nullptr;
+  ensure_populated(POPULATE_CARDS);
+  return cards_.Get(device.card_idx_);
 }
 
-Device* PulseClient::get_device(std::vector<Device>& devices,
-                                const uint32_t index) {
-  for (Device& device : devices) {
-    if (device.index_ == index) return &device;
+Device* PulseClient::get_device(Collection<Device>& devices, const std::string& name) {
+  Device* device = devices.Get(name);
+  return device != nullptr ? device : find_fuzzy(devices, name);
+}
+
+Device* PulseClient::lookup_device(DeviceType type, const uint32_t index) {
+  Device* device = device_list(type).Get(index);
+  if (device == nullptr && !(populated_ & populate_mask(type))) {
+    device = fetch_device(type, index, nullptr);
   }
-  return nullptr;
+  return settle(device);
 }
 
-Device* PulseClient::get_device(std::vector<Device>& devices, const std::string& name) {
+Device* PulseClient::lookup_device(DeviceType type, const std::string& name) {
   long val;
   if (xstrtol(name.c_str(), &val) == 0) {
-    return get_device(devices, val);
-  } else {
-    return find_fuzzy(devices, name);
+    return lookup_device(type, val);
+  }
+
+  const char* alias = default_device_alias(type);
+  if (populated_ & populate_mask(type)) {
+    if (alias != nullptr && name == alias) {
+      return settle(get_device(device_list(type), GetDefaults().GetDefault(type)));
+    }
+    return settle(get_device(device_list(type), name));
+  }
+
+  // Sinks and sources have unique names, so the server can look those up
+  // for us. Anything else needs the full list for a fuzzy match.
+  if (alias != nullptr) {
+    Device* device = device_list(type).Get(name);
+    if (device != nullptr) return settle(device);
+
+    device = fetch_device(type, PA_INVALID_INDEX, name.c_str());
+    if (device != nullptr) return settle(device);
+  }
+
+  ensure_populated(populate_mask(type));
+  return settle(get_device(device_list(type), name));
+}
+
+Device* PulseClient::fetch_device(DeviceType type,
+                                  const uint32_t index,
+                                  const char* name) {
+  std::vector<Device> found;
+  WaitOperationComplete(query_device(type, index, name, &found));
+
+  if (found.empty()) return nullptr;
+
+  // An alias may resolve to a device which was already fetched.
+  return &device_list(type).Put(found[0]);
+}
+
+pa_operation* PulseClient::query_device(DeviceType type,
+                                        const uint32_t index,
+                                        const char* name,
+                                        std::vector<Device>* found) {
+  void* raw = static_cast<void*>(found);
+
+  switch (type) {
+  case DeviceType::SINK:
+    return name != nullptr ?
+        pa_context_get_sink_info_by_name(
+            context(), name, single_device_info_cb, raw) :
+        pa_context_get_sink_info_by_index(
+            context(), index, single_device_info_cb, raw);
+  case DeviceType::SOURCE:
+    return name != nullptr ?
+        pa_context_get_source_info_by_name(
+            context(), name, single_device_info_cb, raw) :
+        pa_context_get_source_info_by_index(
+            context(), index, single_device_info_cb, raw);
+  case DeviceType::SINK_INPUT:
+    return pa_context_get_sink_input_info(
+        context(), index, single_device_info_cb, raw);
+  case DeviceType::SOURCE_OUTPUT:
+    return pa_context_get_source_output_info(
+        context(), index, single_device_info_cb, raw);
+  }
+
+  throw unreachable();
+}
+
+Collection<Device>& PulseClient::device_list(DeviceType type) {
+  switch (type) {
+  case DeviceType::SINK:
+    return sinks_;
+  case DeviceType::SOURCE:
+    return sources_;
+  case DeviceType::SINK_INPUT:
+    return sink_inputs_;
+  case DeviceType::SOURCE_OUTPUT:
+    return source_outputs_;
+  }
+
+  throw unreachable();
+}
+
+unsigned PulseClient::facility_mask(unsigned facility) {
+  switch (facility) {
+  case PA_SUBSCRIPTION_EVENT_SERVER:
+    return POPULATE_SERVER_INFO;
+  case PA_SUBSCRIPTION_EVENT_CARD:
+    return POPULATE_CARDS;
+  case PA_SUBSCRIPTION_EVENT_SINK:
+    return POPULATE_SINKS;
+  case PA_SUBSCRIPTION_EVENT_SOURCE:
+    return POPULATE_SOURCES;
+  case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+    return POPULATE_SINK_INPUTS;
+  case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
+    return POPULATE_SOURCE_OUTPUTS;
+  default:
+    return 0;
   }
 }
 
+unsigned PulseClient::populate_mask(DeviceType type) {
+  switch (type) {
+  case DeviceType::SINK:
+    return POPULATE_SINKS;
+  case DeviceType::SOURCE:
+    return POPULATE_SOURCES;
+  case DeviceType::SINK_INPUT:
+    return POPULATE_SINK_INPUTS;
+  case DeviceType::SOURCE_OUTPUT:
+    return POPULATE_SOURCE_OUTPUTS;
+  }
+
+  throw unreachable();
+}
+
 Device* PulseClient::GetDevice(const uint32_t index, DeviceType type) {
   switch (type) {
   case DeviceType::SINK:
@@ -203,7 +1040,15 @@ Device* PulseClient::GetDevice(const std::string& name, DeviceType type) {
   throw unreachable();
 }
 
-const std::vector<Device>& PulseClient::GetDevices(DeviceType type) const {
+Device* PulseClient::RefreshDevice(const Device& device) {
+  const DeviceType type = device.Type();
+  const uint32_t index = device.Index();
+  Device* refreshed = fetch_device(type, index, nullptr);
+  if (refreshed == nullptr) remove_device(type, index);
+  return refreshed;
+}
+
+const std::list<Device>& PulseClient::GetDevices(DeviceType type) {
   switch (type) {
   case DeviceType::SINK:
     return GetSinks();
@@ -218,54 +1063,160 @@ const std::vector<Device>& PulseClient::GetDevices(DeviceType type) const {
   throw unreachable();
 }
 
+std::vector<Device*> PulseClient::SelectDevices(
+    DeviceType type, const char* glob, const std::vector<const char*>& props) {
+  wait_operations([type](const Operation& operation) {
+    return operation.type == type;
+  });
+
+  Collection<Device>& devices = device_list(type);
+  std::vector<Device*> selected;
+  if (props.empty()) {
+    ensure_populated(populate_mask(type));
+    for (Device& device : devices) selected.push_back(&device);
+  } else {
+    PropertyMatch match{ &devices, &props, {} };
+    void* raw = static_cast<void*>(&match);
+    pa_operation* op = nullptr;
+
+    devices.BeginRefresh();
+    switch (type) {
+    case DeviceType::SINK:
+      op = pa_context_get_sink_info_list(context(), property_match_cb, raw);
+      break;
+    case DeviceType::SOURCE:
+      op = pa_context_get_source_info_list(context(), property_match_cb, raw);
+      break;
+    case DeviceType::SINK_INPUT:
+      op = pa_context_get_sink_input_info_list(context(), property_match_cb, raw);
+      break;
+    case DeviceType::SOURCE_OUTPUT:
+      op = pa_context_get_source_output_info_list(
+          context(), property_match_cb, raw);
+      break;
+    }
+
+    finish_populate(populate_mask(type), { op });
+
+    for (uint32_t index : match.matched) {
+      Device* device = devices.Get(index);
+      if (device != nullptr) selected.push_back(device);
+    }
+  }
+
+  if (glob == nullptr) return selected;
+
+  auto matches = [glob](const char* text) {
+    return fnmatch(glob, text, 0) == 0;
+  };
+  selected.erase(std::remove_if(selected.begin(), selected.end(),
+      [&matches](const Device* device) {
+        if (matches(device->Name()) || matches(device->Desc())) return false;
+        for (const char* prop : device->Props()) {
+          if (*prop != '\0' && matches(prop)) return false;
+        }
+        return true;
+      }), selected.end());
+  return selected;
+}
+
 Device* PulseClient::GetSink(const uint32_t index) {
-  return get_device(sinks_, index);
+  return lookup_device(DeviceType::SINK, index);
 }
 
 Device* PulseClient::GetSink(const std::string& name) {
-  return get_device(sinks_, name);
+  return lookup_device(DeviceType::SINK, name);
+}
+
+const std::list<Device>& PulseClient::GetSinks() {
+  ensure_populated(POPULATE_SINKS);
+  wait_operations([](const Operation& operation) {
+    return operation.type == DeviceType::SINK;
+  });
+  return sinks_.Items();
 }
 
 Device* PulseClient::GetSource(const uint32_t index) {
-  return get_device(sources_, index);
+  return lookup_device(DeviceType::SOURCE, index);
 }
 
 Device* PulseClient::GetSource(const std::string& name) {
-  return get_device(sources_, name);
+  return lookup_device(DeviceType::SOURCE, name);
+}
+
+const std::list<Device>& PulseClient::GetSources() {
+  ensure_populated(POPULATE_SOURCES);
+  wait_operations([](const Operation& operation) {
+    return operation.type == DeviceType::SOURCE;
+  });
+  return sources_.Items();
 }
 
 Device* PulseClient::GetSinkInput(const uint32_t index) {
-  return get_device(sink_inputs_, index);
+  return lookup_device(DeviceType::SINK_INPUT, index);
 }
 
 Device* PulseClient::GetSinkInput(const std::string& name) {
-  return get_device(sink_inputs_, name);
+  return lookup_device(DeviceType::SINK_INPUT, name);
+}
+
+const std::list<Device>& PulseClient::GetSinkInputs() {
+  ensure_populated(POPULATE_SINK_INPUTS);
+  wait_operations([](const Operation& operation) {
+    return operation.type == DeviceType::SINK_INPUT;
+  });
+  return sink_inputs_.Items();
 }
 
 Device* PulseClient::GetSourceOutput(const uint32_t index) {
-  return get_device(source_outputs_, index);
+  return lookup_device(DeviceType::SOURCE_OUTPUT, index);
 }
 
 Device* PulseClient::GetSourceOutput(const std::string& name) {
-  return get_device(source_outputs_, name);
+  return lookup_device(DeviceType::SOURCE_OUTPUT, name);
+}
+
+const std::list<Device>& PulseClient::GetSourceOutputs() {
+  ensure_populated(POPULATE_SOURCE_OUTPUTS);
+  wait_operations([](const Operation& operation) {
+    return operation.type == DeviceType::SOURCE_OUTPUT;
+  });
+  return source_outputs_.Items();
+}
+
+const std::list<Card>& PulseClient::GetCards() {
+  ensure_populated(POPULATE_CARDS);
+  return cards_.Items();
+}
+
+const ServerInfo& PulseClient::GetDefaults() {
+  ensure_populated(POPULATE_SERVER_INFO);
+  wait_operations([](const Operation& operation) {
+    return operation.sets_default;
+  });
+  return defaults_;
 }
 
 void PulseClient::WaitOperationComplete(pa_operation* op) {
+  Phase phase("wait");
   int r;
   while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
+    Timings::Count("mainloop iterations");
     pa_mainloop_iterate(mainloop_, 1, &r);
   }
 
   pa_operation_unref(op);
 }
 
-template<class T>
-T* PulseClient::find_fuzzy(std::vector<T>& haystack, const std::string& needle) {
-  std::vector<T*> res;
+void PulseClient::WaitOperationComplete(const std::vector<pa_operation*>& ops) {
+  // Every iteration dispatches whatever replies have arrived, so waiting on
+  // each operation in turn doesn't serialize them.
+  for (pa_operation* op : ops) WaitOperationComplete(op);
+}
 
-  for (T& item : haystack) {
-    if (item.name_.find(needle) != std::string::npos) res.push_back(&item);
-  }
+template<class T>
+T* PulseClient::find_fuzzy(Collection<T>& haystack, const std::string& needle) {
+  std::vector<T*> res = haystack.Find(needle);
 
   switch (res.size()) {
   case 0:
@@ -274,87 +1225,249 @@ T* PulseClient::find_fuzzy(std::vector<T>& haystack, const std::string& needle)
     break;
   default:
     warnx("warning: ambiguous result for '%s', using '%s'",
-        needle.c_str(), res[0]->name_.c_str());
+        needle.c_str(), res[0]->Name());
   }
   return res[0];
 }
 
-void PulseClient::populate_cards() {
-  std::vector<Card> cards;
-  WaitOperationComplete(pa_context_get_card_info_list(
-        context_, card_info_cb, static_cast<void*>(&cards)));
+void SubstringIndex::Add(size_t slot, Field field, const std::string& text) {
+  Tier& tier = tiers_[field];
+  const size_t id = tier.texts.size();
+  tier.texts.push_back({ slot, text });
 
-  cards_ = std::move(cards);
+  for (size_t i = 0; i + 3 <= text.size(); i++) {
+    std::vector<size_t>& ids = tier.trigrams[trigram(&text[i])];
+    if (ids.empty() || ids.back() != id) ids.push_back(id);
+  }
 }
 
-void PulseClient::populate_server_info() {
-  WaitOperationComplete(pa_context_get_server_info(
-        context_, server_info_cb, &defaults_));
+void SubstringIndex::Clear() {
+  for (Tier& tier : tiers_) {
+    tier.texts.clear();
+    tier.trigrams.clear();
+  }
 }
 
-void PulseClient::populate_sinks() {
-  std::vector<Device> sinks;
-  WaitOperationComplete(pa_context_get_sink_info_list(
-      context_, device_info_cb, static_cast<void*>(&sinks)));
-  sinks_ = std::move(sinks);
+std::vector<size_t> SubstringIndex::Find(const std::string& needle) const {
+  std::vector<size_t> slots;
+
+  for (const Tier& tier : tiers_) {
+    // Every text containing the needle contains each of its trigrams, so
+    // only those with the rarest one need checking. Shorter needles have
+    // to be checked against everything.
+    const std::vector<size_t>* candidates = nullptr;
+    for (size_t i = 0; i + 3 <= needle.size(); i++) {
+      auto iter = tier.trigrams.find(trigram(&needle[i]));
+      if (iter == tier.trigrams.end()) {
+        static const std::vector<size_t> none;
+        candidates = &none;
+        break;
+      }
+      if (candidates == nullptr || iter->second.size() < candidates->size()) {
+        candidates = &iter->second;
+      }
+    }
 
-  std::vector<Device> sink_inputs;
-  WaitOperationComplete(pa_context_get_sink_input_info_list(
-      context_, device_info_cb, static_cast<void*>(&sink_inputs)));
-  sink_inputs_ = std::move(sink_inputs);
+    auto check = [&](size_t id) {
+      const Text& text = tier.texts[id];
+      if (text.text.find(needle) != std::string::npos) slots.push_back(text.slot);
+    };
+    if (candidates != nullptr) {
+      for (size_t id : *candidates) check(id);
+    } else {
+      for (size_t id = 0; id < tier.texts.size(); id++) check(id);
+    }
+
+    if (!slots.empty()) break;
+  }
+
+  std::sort(slots.begin(), slots.end());
+  slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+  return slots;
 }
 
-void PulseClient::populate_sources() {
-  std::vector<Device> sources;
-  WaitOperationComplete(pa_context_get_source_info_list(
-      context_, device_info_cb, static_cast<void*>(&sources)));
-  sources_ = std::move(sources);
+pa_operation* PulseClient::populate_cards() {
+  cards_.BeginRefresh();
+  return pa_context_get_card_info_list(
+      context(), card_info_cb, static_cast<void*>(&cards_));
+}
 
-  std::vector<Device> source_outputs;
-  WaitOperationComplete(pa_context_get_source_output_info_list(
-      context_, device_info_cb, static_cast<void*>(&source_outputs)));
-  source_outputs_ = std::move(source_outputs);
+pa_operation* PulseClient::populate_server_info() {
+  return pa_context_get_server_info(context(), server_info_cb, &defaults_);
 }
 
-bool PulseClient::SetMute(Device& device, bool mute) {
-  int success;
+pa_operation* PulseClient::populate_sinks() {
+  sinks_.BeginRefresh();
+  return pa_context_get_sink_info_list(
+      context(), device_info_cb, static_cast<void*>(&sinks_));
+}
+
+pa_operation* PulseClient::populate_sink_inputs() {
+  sink_inputs_.BeginRefresh();
+  return pa_context_get_sink_input_info_list(
+      context(), device_info_cb, static_cast<void*>(&sink_inputs_));
+}
+
+pa_operation* PulseClient::populate_sources() {
+  sources_.BeginRefresh();
+  return pa_context_get_source_info_list(
+      context(), device_info_cb, static_cast<void*>(&sources_));
+}
+
+pa_operation* PulseClient::populate_source_outputs() {
+  source_outputs_.BeginRefresh();
+  return pa_context_get_source_output_info_list(
+      context(), device_info_cb, static_cast<void*>(&source_outputs_));
+}
 
-  if (device.ops_.Mute == nullptr) {
+bool PulseClient::SetMute(Device& device, bool mute) {
+  if (device.ops_->Mute == nullptr) {
     warnx("device does not support muting.");
     return false;
   }
 
-  WaitOperationComplete(device.ops_.Mute(
-          context_, device.index_, mute, success_cb, &success));
-
-  if (success) {
+  std::shared_ptr<Notifier> notifier = notifier_;
+  Operation* operation = new_operation(device, [notifier, mute](Device& device) {
     device.mute_ = mute;
-    notifier_->Notify(mute ? NotificationType::MUTE : NotificationType::UNMUTE,
-                      device.volume_percent_, mute);
-  }
+    notifier->Notify(mute ? NotificationType::MUTE : NotificationType::UNMUTE,
+                     device.volume_percent_, mute);
+  });
 
-  return success;
+  return submit(operation, send_mute(device, mute, operation));
 }
 
 bool PulseClient::SetVolume(Device& device, long volume) {
-  int success;
+  if (device.ops_->SetVolume == nullptr) {
+    warnx("device does not support setting volume.");
+    return false;
+  }
+
+  volume = volume_range_.Clamp(volume);
+  pa_cvolume cvol = device.volume();
+  value_to_cvol(volume, &cvol);
 
-  if (device.ops_.SetVolume == nullptr) {
+  std::shared_ptr<Notifier> notifier = notifier_;
+  Operation* operation = new_operation(device, [notifier, cvol](Device& device) {
+    device.update_volume(cvol);
+    notifier->Notify(NotificationType::VOLUME, device.volume_percent_, device.mute_);
+  });
+
+  return submit(operation, send_volume(device, &cvol, operation));
+}
+
+bool PulseClient::FadeVolume(Device& device, long volume, long duration,
+                             FadeCurve curve) {
+  if (device.ops_->SetVolume == nullptr) {
     warnx("device does not support setting volume.");
     return false;
   }
 
+  if (duration < 0) {
+    warnx("fade duration can't be negative.");
+    return false;
+  }
+
+  // Start from wherever changes still in flight leave the device.
+  Device* target = settle(&device);
+  if (target == nullptr) return false;
+
   volume = volume_range_.Clamp(volume);
-  const pa_cvolume *cvol = value_to_cvol(volume, &device.volume_);
-  WaitOperationComplete(device.ops_.SetVolume(
-          context_, device.index_, cvol, success_cb, &success));
+  const pa_cvolume volume_at_start = target->volume();
+  Fade fade{
+    this, target->type_, target->index_,
+    pa_cvolume_max(&volume_at_start),
+    static_cast<pa_volume_t>(std::max(volume * PA_VOLUME_NORM / 100.0, 0.0)),
+    curve, pa_rtclock_now(), static_cast<pa_usec_t>(duration) * PA_USEC_PER_MSEC,
+  };
+
+  pa_mainloop_api* api = MainloopApi();
+  struct timeval tv;
+  pa_time_event* timer = api->time_new(
+      api, pa_timeval_rtstore(&tv, fade.start, true), fade_timer_cb, &fade);
+  while (!fade.done) {
+    Timings::Count("mainloop iterations");
+    if (pa_mainloop_iterate(mainloop_, 1, nullptr) < 0) break;
+  }
+  api->time_free(timer);
 
-  if (success) {
-    device.update_volume(*cvol);
-    notifier_->Notify(NotificationType::VOLUME, device.volume_percent_, device.mute_);
+  // If the mainloop failed with a step still in flight, its reply must not
+  // arrive once the step is gone.
+  if (fade.step != nullptr) {
+    if (pa_operation_get_state(fade.step->op) == PA_OPERATION_RUNNING) {
+      pa_operation_cancel(fade.step->op);
+    }
+    pa_operation_unref(fade.step->op);
+    delete fade.step;
   }
+  return fade.done && fade.success;
+}
 
-  return success;
+void PulseClient::fade_timer_cb(pa_mainloop_api* api,
+                                pa_time_event* event,
+                                const struct timeval*,
+                                void* raw) {
+  auto fade = static_cast<Fade*>(raw);
+  PulseClient* client = fade->client;
+
+  // If the server hasn't caught up with the last step, skip this one. The
+  // next step supersedes it anyway.
+  if (fade->step != nullptr) {
+    if (pa_operation_get_state(fade->step->op) == PA_OPERATION_RUNNING) {
+      struct timeval tv;
+      api->time_restart(
+          event, pa_timeval_rtstore(&tv, pa_rtclock_now() + kFadeStepUsec, true));
+      return;
+    }
+
+    const bool success = fade->step->success;
+    pa_operation_unref(fade->step->op);
+    delete fade->step;
+    fade->step = nullptr;
+
+    if (!success || fade->last) {
+      fade->success = success;
+      fade->done = true;
+      return;
+    }
+  }
+
+  Device* device = client->device_list(fade->type).Get(fade->index);
+  if (device == nullptr) {
+    fade->done = true;
+    return;
+  }
+
+  const pa_usec_t now = pa_rtclock_now();
+  const double progress = fade->duration == 0 ?
+      1.0 : static_cast<double>(now - fade->start) / fade->duration;
+  fade->last = progress >= 1.0;
+
+  pa_cvolume cvol = device->volume();
+  pa_cvolume_scale(&cvol, fade_volume(fade->from, fade->to, progress, fade->curve));
+
+  // Only announce where the fade ends up.
+  std::shared_ptr<Notifier> notifier = client->notifier_;
+  const bool last = fade->last;
+  fade->step = client->new_operation(*device, [notifier, cvol, last](Device& device) {
+    device.update_volume(cvol);
+    if (last) {
+      notifier->Notify(NotificationType::VOLUME, device.volume_percent_, device.mute_);
+    }
+  });
+  fade->step->op = device->ops_->SetVolume(
+      client->context(), fade->index, &cvol, operation_cb, fade->step);
+  if (fade->step->op == nullptr) {
+    warnx("failed to set volume: %s",
+          pa_strerror(pa_context_errno(client->context())));
+    delete fade->step;
+    fade->step = nullptr;
+    fade->success = false;
+    fade->done = true;
+    return;
+  }
+
+  struct timeval tv;
+  api->time_restart(event, pa_timeval_rtstore(&tv, now + kFadeStepUsec, true));
 }
 
 bool PulseClient::IncreaseVolume(Device& device, long increment) {
@@ -366,26 +1479,23 @@ bool PulseClient::DecreaseVolume(Device& device, long increment) {
 }
 
 bool PulseClient::SetBalance(Device& device, long balance) {
-  if (device.ops_.SetVolume == nullptr) {
+  if (device.ops_->SetVolume == nullptr) {
     warnx("device does not support setting balance.");
     return false;
   }
 
   balance = balance_range_.Clamp(balance);
-  pa_cvolume *cvol = pa_cvolume_set_balance(&device.volume_,
-                                            &device.channels_,
-                                            balance / 100.0);
+  pa_cvolume cvol = device.volume();
+  const pa_channel_map channels = device.channel_map();
+  pa_cvolume_set_balance(&cvol, &channels, balance / 100.0);
 
-  int success;
-  WaitOperationComplete(device.ops_.SetVolume(
-          context_, device.index_, cvol, success_cb, &success));
-
-  if (success) {
-    device.update_volume(*cvol);
-    notifier_->Notify(NotificationType::BALANCE, device.balance_, false);
-  }
+  std::shared_ptr<Notifier> notifier = notifier_;
+  Operation* operation = new_operation(device, [notifier, cvol](Device& device) {
+    device.update_volume(cvol);
+    notifier->Notify(NotificationType::BALANCE, device.balance_, false);
+  });
 
-  return success;
+  return submit(operation, send_volume(device, &cvol, operation));
 }
 
 bool PulseClient::IncreaseBalance(Device& device, long increment) {
@@ -407,13 +1517,14 @@ int PulseClient::GetBalance(const Device& device) const {
 bool PulseClient::SetProfile(Card& card, const std::string& profile) {
   int success;
   WaitOperationComplete(pa_context_set_card_profile_by_index(
-          context_, card.index_, profile.c_str(), success_cb, &success));
+          context(), card.index_, profile.c_str(), success_cb, &success));
 
   if (success) {
     // Update the profile
-    for (const Profile& p : card.profiles_) {
+    for (const Profile p : card.Profiles()) {
       if (p.name == profile) {
-        card.active_profile_ = p;
+        card.active_at_ = p.name - card.packed_.At(0);
+        card.has_active_ = true;
         break;
       }
     }
@@ -423,86 +1534,307 @@ bool PulseClient::SetProfile(Card& card, const std::string& profile) {
 }
 
 bool PulseClient::Move(Device& source, Device& dest) {
-  if (source.ops_.Move == nullptr) {
+  if (source.ops_->Move == nullptr) {
     warnx("source device does not support moving.");
     return false;
   }
 
-  int success;
-  WaitOperationComplete(source.ops_.Move(
-          context_, source.index_, dest.index_, success_cb, &success));
+  const uint32_t owner = dest.index_;
+  Operation* operation = new_operation(source, [owner](Device& device) {
+    device.owner_idx_ = owner;
+  });
+  return submit(operation, source.ops_->Move(
+          context(), source.index_, dest.index_, operation_cb, operation));
+}
+
+bool PulseClient::MoveStreams(Device& dest) {
+  DeviceType type;
+  const char* noun;
+  switch (dest.type_) {
+  case DeviceType::SINK:
+    type = DeviceType::SINK_INPUT;
+    noun = "sink input";
+    break;
+  case DeviceType::SOURCE:
+    type = DeviceType::SOURCE_OUTPUT;
+    noun = "source output";
+    break;
+  default:
+    warnx("only sinks and sources have streams to move.");
+    return false;
+  }
 
+  ensure_populated(populate_mask(type));
+  wait_operations([type](const Operation& operation) {
+    return operation.type == type;
+  });
+
+  // Send every move before waiting for any, so that moving them all takes
+  // one round trip however many there are.
+  const uint32_t owner = dest.index_;
+  std::vector<Operation*> operations;
+  for (Device& stream : device_list(type)) {
+    if (stream.owner_idx_ == owner) continue;
+
+    Operation* operation = new_operation(stream, [owner](Device& device) {
+      device.owner_idx_ = owner;
+    });
+    operation->quiet = true;
+    operation->op = stream.ops_->Move(
+        context(), stream.index_, owner, operation_cb, operation);
+    operations.push_back(operation);
+  }
+
+  bool success = true;
+  for (Operation* operation : operations) {
+    WaitOperationComplete(operation->op);
+    if (!operation->success) {
+      const Device* stream = device_list(type).Get(operation->index);
+      warnx("failed to move %s %u (%s): %s", noun, operation->index,
+            stream != nullptr ? stream->Desc() : "", pa_strerror(operation->error));
+      success = false;
+    }
+    delete operation;
+  }
   return success;
 }
 
 bool PulseClient::Kill(Device& device) {
-  if (device.ops_.Kill == nullptr) {
+  if (device.ops_->Kill == nullptr) {
     warnx("source device does not support being killed.");
     return false;
   }
 
-  int success;
-  WaitOperationComplete(device.ops_.Kill(
-          context_, device.index_, success_cb, &success));
-
-  if (success) remove_device(device);
+  Operation* operation = new_operation(device, [this](Device& device) {
+    remove_device(device);
+  });
 
-  return success;
+  return submit(operation, device.ops_->Kill(
+          context(), device.index_, operation_cb, operation));
 }
 
 bool PulseClient::SetDefault(Device& device) {
-  int success;
-
-  if (device.ops_.SetDefault == nullptr) {
+  if (device.ops_->SetDefault == nullptr) {
     warnx("device does not support defaults");
     return false;
   }
 
-  WaitOperationComplete(device.ops_.SetDefault(
-          context_, device.name_.c_str(), success_cb, &success));
-
-  if (success) {
+  Operation* operation = new_operation(device, [this](Device& device) {
     switch (device.type_) {
     case DeviceType::SINK:
-      defaults_.sink = device.name_;
+      defaults_.sink = device.Name();
       break;
     case DeviceType::SOURCE:
-      defaults_.source = device.name_;
+      defaults_.source = device.Name();
       break;
     default:
       errx(1, "impossible to set a default for device type %d",
            static_cast<int>(device.type_));
     }
-  }
+  });
+  operation->sets_default = true;
 
-  return success;
+  return submit(operation, device.ops_->SetDefault(
+          context(), device.Name(), operation_cb, operation));
 }
 
-void PulseClient::remove_device(Device& device) {
-  std::vector<Device>* devlist = nullptr;
+bool PulseClient::MonitorPeaks(Device& device, int rate,
+                               std::function<void(float)> callback) {
+  uint32_t source = PA_INVALID_INDEX;
+  uint32_t stream = PA_INVALID_INDEX;
 
   switch (device.type_) {
   case DeviceType::SINK:
-    devlist = &sinks_;
-    break;
-  case DeviceType::SINK_INPUT:
-    devlist = &sink_inputs_;
+    source = device.monitor_idx_;
     break;
   case DeviceType::SOURCE:
-    devlist = &sources_;
+    source = device.index_;
+    break;
+  case DeviceType::SINK_INPUT: {
+    stream = device.index_;
+    Device* sink = GetSink(device.owner_idx_);
+    if (sink != nullptr) source = sink->monitor_idx_;
     break;
+  }
   case DeviceType::SOURCE_OUTPUT:
-    devlist = &source_outputs_;
+    source = device.owner_idx_;
     break;
   }
-  devlist->erase(
-      std::remove_if(
-        devlist->begin(), devlist->end(),
-        [&device](const Device& d) { return d.index_ == device.index_; }),
-      devlist->end());
+
+  if (source == PA_INVALID_INDEX) {
+    warnx("device has nothing to monitor.");
+    return false;
+  }
+
+  // The server does the peak detection: each sample it sends is the peak
+  // over the preceding 1/rate seconds.
+  pa_sample_spec spec;
+  spec.format = PA_SAMPLE_FLOAT32NE;
+  spec.rate = rate;
+  spec.channels = 1;
+
+  pa_buffer_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.maxlength = static_cast<uint32_t>(-1);
+  attr.fragsize = sizeof(float);
+
+  peak_callback_ = std::move(callback);
+  peak_stream_ = pa_stream_new(context(), "Peak detect", &spec, nullptr);
+  pa_stream_set_read_callback(peak_stream_, peak_read_cb, this);
+  pa_stream_set_state_callback(peak_stream_, peak_state_cb, MainloopApi());
+  if (stream != PA_INVALID_INDEX) {
+    pa_stream_set_monitor_stream(peak_stream_, stream);
+  }
+
+  const std::string name = std::to_string(source);
+  if (pa_stream_connect_record(
+        peak_stream_, name.c_str(), &attr,
+        static_cast<pa_stream_flags_t>(PA_STREAM_DONT_MOVE |
+                                       PA_STREAM_PEAK_DETECT |
+                                       PA_STREAM_ADJUST_LATENCY)) < 0) {
+    warnx("failed to monitor device: %s",
+          pa_strerror(pa_context_errno(context())));
+    return false;
+  }
+
+  pa_context_set_state_callback(context(), context_lost_cb, MainloopApi());
+  return true;
 }
 
-void PulseClient::SetNotifier(std::unique_ptr<Notifier> notifier) {
+void PulseClient::peak_read_cb(pa_stream* stream,
+                               size_t length __attribute__((unused)),
+                               void* raw) {
+  auto client = static_cast<PulseClient*>(raw);
+
+  const void* data;
+  size_t size;
+  while (pa_stream_peek(stream, &data, &size) == 0 && size > 0) {
+    // A hole in the stream carries no data, and needs dropping all the same.
+    if (data != nullptr) {
+      client->peak_callback_(
+          peak_level(static_cast<const float*>(data), size / sizeof(float)));
+    }
+    pa_stream_drop(stream);
+  }
+}
+
+void PulseClient::peak_state_cb(pa_stream* stream, void* raw) {
+  switch (pa_stream_get_state(stream)) {
+  case PA_STREAM_FAILED:
+  case PA_STREAM_TERMINATED: {
+    fprintf(stderr, "monitor stream went away: %s\n",
+        pa_strerror(pa_context_errno(pa_stream_get_context(stream))));
+    auto api = static_cast<pa_mainloop_api*>(raw);
+    api->quit(api, 1);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void PulseClient::operation_cb(pa_context* context, int success, void* raw) {
+  auto operation = static_cast<Operation*>(raw);
+  PulseClient* client = operation->client;
+
+  operation->success = success;
+  if (!success) {
+    operation->error = pa_context_errno(context);
+    if (!operation->quiet) {
+      fprintf(stderr, "operation failed: %s\n", pa_strerror(operation->error));
+    }
+    return;
+  }
+
+  // The device may have gone away while we weren't looking.
+  Device* device = client->device_list(operation->type).Get(operation->index);
+  if (device != nullptr) operation->apply(*device);
+}
+
+PulseClient::Operation* PulseClient::new_operation(
+    const Device& device, std::function<void(Device&)> apply) {
+  return new Operation{ this, device.type_, device.index_, std::move(apply) };
+}
+
+pa_operation* PulseClient::send_mute(const Device& device, bool mute,
+                                     Operation* operation) {
+  if (by_name_ && device.ops_->MuteByName != nullptr) {
+    return device.ops_->MuteByName(
+        context(), device.Name(), mute, operation_cb, operation);
+  }
+  return device.ops_->Mute(
+      context(), device.index_, mute, operation_cb, operation);
+}
+
+pa_operation* PulseClient::send_volume(const Device& device,
+                                       const pa_cvolume* cvol,
+                                       Operation* operation) {
+  if (by_name_ && device.ops_->SetVolumeByName != nullptr) {
+    return device.ops_->SetVolumeByName(
+        context(), device.Name(), cvol, operation_cb, operation);
+  }
+  return device.ops_->SetVolume(
+      context(), device.index_, cvol, operation_cb, operation);
+}
+
+bool PulseClient::submit(Operation* operation, pa_operation* op) {
+  operation->op = op;
+  if (async_) {
+    pending_.push_back(operation);
+    return true;
+  }
+
+  WaitOperationComplete(op);
+  bool success = operation->success;
+  delete operation;
+  return success;
+}
+
+template<class Predicate>
+void PulseClient::wait_operations(Predicate pred) {
+  for (auto iter = pending_.begin(); iter != pending_.end();) {
+    Operation* operation = *iter;
+    if (!pred(*operation)) {
+      ++iter;
+      continue;
+    }
+
+    WaitOperationComplete(operation->op);
+    if (!operation->success) failed_ = true;
+    delete operation;
+    iter = pending_.erase(iter);
+  }
+}
+
+Device* PulseClient::settle(Device* device) {
+  if (device == nullptr || pending_.empty()) return device;
+
+  const DeviceType type = device->type_;
+  const uint32_t index = device->index_;
+  wait_operations([type, index](const Operation& operation) {
+    return operation.type == type && operation.index == index;
+  });
+  return device_list(type).Get(index);
+}
+
+bool PulseClient::Flush() {
+  wait_operations([](const Operation&) { return true; });
+
+  bool success = !failed_;
+  failed_ = false;
+  return success;
+}
+
+void PulseClient::remove_device(Device& device) {
+  // device may live in the list we're about to modify.
+  remove_device(device.type_, device.index_);
+}
+
+void PulseClient::remove_device(DeviceType type, const uint32_t index) {
+  device_list(type).Remove(index);
+}
+
+void PulseClient::SetNotifier(std::shared_ptr<Notifier> notifier) {
   notifier_ = std::move(notifier);
 }
 
@@ -511,13 +1843,46 @@ void PulseClient::SetNotifier(std::unique_ptr<Notifier> notifier) {
 //
 Card::Card(const pa_card_info* info) :
     index_(info->index),
-    name_(info->name),
-    owner_module_(info->owner_module),
-    driver_(info->driver),
-    active_profile_(*info->active_profile) {
+    owner_module_(info->owner_module) {
+  const char* desc = pa_proplist_gets(info->proplist,
+                                      PA_PROP_DEVICE_DESCRIPTION);
+  if (desc == nullptr) desc = "";
+  const char* driver = info->driver ? info->driver : "";
+  const char* props[kMaxMatchProps];
+  match_props(info->proplist, props);
+
+  size_t size = strlen(info->name) + strlen(desc) + strlen(driver) + 3;
+  for (size_t i = 0; i < kMaxMatchProps; i++) size += strlen(props[i]) + 1;
   for (int i = 0; info->profiles[i].name != nullptr; i++) {
-    profiles_.push_back(info->profiles[i]);
+    size += strlen(info->profiles[i].name) +
+            strlen(info->profiles[i].description) + 2;
   }
+  packed_.Reserve(size);
+
+  name_at_ = packed_.Add(info->name);
+  desc_at_ = packed_.Add(desc);
+  driver_at_ = packed_.Add(driver);
+  props_at_ = packed_.Size();
+  for (size_t i = 0; i < kMaxMatchProps; i++) packed_.Add(props[i]);
+
+  profiles_at_ = packed_.Size();
+  for (int i = 0; info->profiles[i].name != nullptr; i++) {
+    const uint32_t at = packed_.Add(info->profiles[i].name);
+    packed_.Add(info->profiles[i].description);
+
+    if (info->active_profile != nullptr &&
+        strcmp(info->active_profile->name, info->profiles[i].name) == 0) {
+      active_at_ = at;
+      has_active_ = true;
+    }
+  }
+}
+
+Profile Card::ActiveProfile() const {
+  if (!has_active_) return Profile{ "", "" };
+
+  const char* name = packed_.At(active_at_);
+  return Profile{ name, name + strlen(name) + 1 };
 }
 
 //
@@ -526,19 +1891,12 @@ Card::Card(const pa_card_info* info) :
 Device::Device(const pa_sink_info* info) :
     type_(DeviceType::SINK),
     index_(info->index),
-    name_(info->name ? info->name : ""),
-    desc_(info->description),
+    ops_(device_operations(type_)),
     mute_(info->mute),
-    card_idx_(info->card) {
-  update_volume(info->volume);
-  channels_ = info->channel_map;
-  balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
-
-  ops_.SetVolume = pa_context_set_sink_volume_by_index;
-  ops_.Mute = pa_context_set_sink_mute_by_index;
-  ops_.Kill = nullptr;
-  ops_.Move = nullptr;
-  ops_.SetDefault = pa_context_set_default_sink;
+    card_idx_(info->card),
+    monitor_idx_(info->monitor_source) {
+  pack(info->name, info->description, info->proplist, info->volume,
+       info->channel_map);
 
   if (info->active_port) {
     switch (info->active_port->available) {
@@ -558,67 +1916,123 @@ Device::Device(const pa_sink_info* info) :
 Device::Device(const pa_source_info* info) :
     type_(DeviceType::SOURCE),
     index_(info->index),
-    name_(info->name ? info->name : ""),
-    desc_(info->description),
+    ops_(device_operations(type_)),
     mute_(info->mute),
     card_idx_(info->card) {
-  update_volume(info->volume);
-  channels_ = info->channel_map;
-  balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
-
-  ops_.SetVolume = pa_context_set_source_volume_by_index;
-  ops_.Mute = pa_context_set_source_mute_by_index;
-  ops_.Kill = nullptr;
-  ops_.Move = nullptr;
-  ops_.SetDefault = pa_context_set_default_source;
+  pack(info->name, info->description, info->proplist, info->volume,
+       info->channel_map);
 }
 
 Device::Device(const pa_sink_input_info* info) :
     type_(DeviceType::SINK_INPUT),
     index_(info->index),
-    name_(info->name ? info->name : ""),
+    ops_(device_operations(type_)),
     mute_(info->mute),
-    card_idx_(-1) {
-  update_volume(info->volume);
-  channels_ = info->channel_map;
-  balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
-
-  const char *desc = pa_proplist_gets(info->proplist,
-                                      PA_PROP_APPLICATION_NAME);
-  if (desc) desc_ = desc;
-
-  ops_.SetVolume = pa_context_set_sink_input_volume;
-  ops_.Mute = pa_context_set_sink_input_mute;
-  ops_.Kill = pa_context_kill_sink_input;
-  ops_.Move = pa_context_move_sink_input_by_index;
-  ops_.SetDefault = nullptr;
+    card_idx_(-1),
+    owner_idx_(info->sink) {
+  pack(info->name,
+       pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME),
+       info->proplist, info->volume, info->channel_map);
 }
 
 Device::Device(const pa_source_output_info* info) :
     type_(DeviceType::SOURCE_OUTPUT),
     index_(info->index),
-    name_(info->name ? info->name : ""),
+    ops_(device_operations(type_)),
     mute_(info->mute),
-    card_idx_(-1) {
-  update_volume(info->volume);
-  volume_percent_ = volume_as_percent(&volume_);
-  balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
+    card_idx_(-1),
+    owner_idx_(info->source) {
+  pack(info->name,
+       pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME),
+       info->proplist, info->volume, info->channel_map);
+}
+
+void Device::pack(const char* name, const char* desc,
+                  const pa_proplist* proplist, const pa_cvolume& volume,
+                  const pa_channel_map& channels) {
+  if (name == nullptr) name = "";
+  if (desc == nullptr) desc = "";
+  const char* props[kMaxMatchProps];
+  match_props(proplist, props);
+
+  // Each channel has a volume and a position, which fits in a byte.
+  channels_ = volume.channels;
+  size_t size = channels_ * (sizeof(pa_volume_t) + 1) +
+                strlen(name) + strlen(desc) + 2;
+  for (size_t i = 0; i < kMaxMatchProps; i++) size += strlen(props[i]) + 1;
+  packed_.Reserve(size);
+
+  packed_.Add(volume.values, channels_ * sizeof(pa_volume_t));
+  for (uint8_t i = 0; i < channels_; i++) {
+    const uint8_t position = i < channels.channels ? channels.map[i] : 0;
+    packed_.Add(&position, 1);
+  }
+
+  name_at_ = packed_.Add(name);
+  desc_at_ = packed_.Add(desc);
+  props_at_ = packed_.Size();
+  for (size_t i = 0; i < kMaxMatchProps; i++) packed_.Add(props[i]);
+
+  update_volume(volume);
+}
+
+Device::Device(const Record& record, const char* packed) :
+    type_(static_cast<DeviceType>(record.type)),
+    index_(record.index),
+    ops_(device_operations(type_)),
+    channels_(record.channels),
+    name_at_(record.name_at),
+    desc_at_(record.desc_at),
+    props_at_(record.props_at),
+    volume_percent_(record.volume_percent),
+    mute_(record.mute),
+    balance_(record.balance),
+    card_idx_(record.card_idx),
+    monitor_idx_(record.monitor_idx),
+    owner_idx_(record.owner_idx),
+    available_(static_cast<Availability>(record.available)) {
+  packed_.Reserve(record.packed_size);
+  packed_.Add(packed, record.packed_size);
+}
 
-  const char *desc = pa_proplist_gets(info->proplist,
-                                      PA_PROP_APPLICATION_NAME);
-  if (desc) desc_ = desc;
+void Device::save(std::string* out) const {
+  const Record record{
+    static_cast<uint8_t>(type_), channels_,
+    static_cast<uint8_t>(available_), static_cast<uint8_t>(mute_),
+    index_, name_at_, desc_at_, props_at_, card_idx_, monitor_idx_,
+    owner_idx_, volume_percent_, balance_, packed_.Size(),
+  };
+  out->append(reinterpret_cast<const char*>(&record), sizeof(record));
+  out->append(packed_.At(0), packed_.Size());
+}
 
-  ops_.SetVolume = pa_context_set_source_output_volume;
-  ops_.Mute = pa_context_set_source_output_mute;
-  ops_.Kill = pa_context_kill_source_output;
-  ops_.Move = pa_context_move_source_output_by_index;
-  ops_.SetDefault = nullptr;
+pa_cvolume Device::volume() const {
+  pa_cvolume cvol;
+  cvol.channels = channels_;
+  packed_.Get(0, cvol.values, channels_ * sizeof(pa_volume_t));
+  return cvol;
+}
+
+pa_channel_map Device::channel_map() const {
+  pa_channel_map channels;
+  channels.channels = channels_;
+  const char* positions = packed_.At(channels_ * sizeof(pa_volume_t));
+  for (uint8_t i = 0; i < channels_; i++) {
+    channels.map[i] = static_cast<pa_channel_position_t>(
+        static_cast<uint8_t>(positions[i]));
+  }
+  return channels;
 }
 
 void Device::update_volume(const pa_cvolume& newvol) {
-  volume_ = newvol;
-  volume_percent_ = volume_as_percent(&volume_);
-  balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
+  // Changes to a device's volume keep its channels, and a change in the
+  // number of channels comes from the server as a whole new device.
+  if (newvol.channels != channels_) return;
+
+  packed_.Set(0, newvol.values, channels_ * sizeof(pa_volume_t));
+  const pa_channel_map channels = channel_map();
+  volume_percent_ = volume_as_percent(&newvol);
+  balance_ = pa_cvolume_get_balance(&newvol, &channels) * 100.0;
 }
 
 // vim: set et ts=2 sw=2:
@@ -6,9 +6,16 @@
 #include <string.h>
 
 // C++
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <map>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 // external
@@ -21,14 +28,81 @@ enum class DeviceType {
   SOURCE_OUTPUT,
 };
 
-struct Profile {
-  Profile(const pa_card_profile_info& info) :
-      name(info.name),
-      desc(info.description) {
+// How the volume moves between its endpoints during a fade: evenly in
+// percent, or evenly in decibels, which the ear hears as even steps.
+enum class FadeCurve {
+  LINEAR,
+  LOG,
+};
+
+// The variable-sized parts of a Device or Card -- strings, each NUL
+// terminated, and raw values such as channel volumes -- packed back to back
+// in a single allocation. Parts are addressed by offset, so copies need no
+// fixing up.
+class Packed {
+ public:
+  void Reserve(size_t size) { data_.reserve(size); }
+
+  // Append a string, or size bytes of data, returning its offset.
+  uint32_t Add(const char* str) {
+    return Add(str, strlen(str) + 1);
+  }
+
+  uint32_t Add(const void* data, size_t size) {
+    const uint32_t offset = data_.size();
+    data_.append(static_cast<const char*>(data), size);
+    return offset;
+  }
+
+  // Read or overwrite size bytes of data at an offset.
+  void Get(uint32_t offset, void* data, size_t size) const {
+    memcpy(data, data_.data() + offset, size);
   }
 
-  std::string name;
-  std::string desc;
+  void Set(uint32_t offset, const void* data, size_t size) {
+    memcpy(&data_[offset], data, size);
+  }
+
+  const char* At(uint32_t offset) const { return data_.data() + offset; }
+  uint32_t Size() const { return data_.size(); }
+
+ private:
+  std::string data_;
+};
+
+// Consecutive strings in a Packed, iterated over as C strings.
+class StringList {
+ public:
+  class iterator {
+   public:
+    explicit iterator(const char* str) : str_(str) {}
+
+    const char* operator*() const { return str_; }
+    iterator& operator++() {
+      str_ += strlen(str_) + 1;
+      return *this;
+    }
+    bool operator!=(const iterator& other) const { return str_ != other.str_; }
+
+   private:
+    const char* str_;
+  };
+
+  StringList(const char* begin, const char* end) : begin_(begin), end_(end) {}
+
+  iterator begin() const { return iterator(begin_); }
+  iterator end() const { return iterator(end_); }
+  bool empty() const { return begin_ == end_; }
+
+ private:
+  const char* begin_;
+  const char* end_;
+};
+
+// A view of one of a Card's profiles, valid as long as the card is.
+struct Profile {
+  const char* name;
+  const char* desc;
 };
 
 struct Operations {
@@ -41,8 +115,29 @@ struct Operations {
   pa_operation* (*Kill)(pa_context*, uint32_t, pa_context_success_cb_t, void*);
   pa_operation* (*Move)(pa_context*, uint32_t, uint32_t,
                         pa_context_success_cb_t, void *);
+  pa_operation* (*MuteByName)(pa_context*, const char*, int,
+                              pa_context_success_cb_t, void*);
+  pa_operation* (*SetVolumeByName)(pa_context*, const char*, const pa_cvolume*,
+                                   pa_context_success_cb_t, void*);
 };
 
+// Scale cvol so that its loudest channel is at value percent, keeping the
+// balance between channels.
+pa_cvolume* value_to_cvol(long value, pa_cvolume* cvol);
+
+// The volume of cvol's loudest channel, in percent.
+int volume_as_percent(const pa_cvolume* cvol);
+
+// Properties, besides the name and description, which are worth picking a
+// device or card by. A device's or card's Props() holds their values in
+// this order, with an empty string for any which isn't set.
+extern const char* const kMatchProps[];
+extern const size_t kMaxMatchProps;
+
+// Devices are made by the thousand on busy hosts, so they're kept small:
+// strings, channel positions and channel volumes share one allocation,
+// sized for the channels the device actually has, and the operations come
+// from a table shared by all devices of a type.
 class Device {
  public:
   enum class Availability {
@@ -57,52 +152,138 @@ class Device {
   Device(const pa_source_output_info* info);
 
   uint32_t Index() const { return index_; }
-  const std::string& Name() const { return name_; }
-  const std::string& Desc() const { return desc_; }
+  const char* Name() const { return packed_.At(name_at_); }
+  const char* Desc() const { return packed_.At(desc_at_); }
+  StringList Props() const {
+    return StringList(packed_.At(props_at_), packed_.At(packed_.Size()));
+  }
   int Volume() const { return volume_percent_; }
   int Balance() const { return balance_; }
   bool Muted() const { return mute_; }
   DeviceType Type() const { return type_; }
+  Availability Available() const { return available_; }
+
+  // The volume and position of each channel.
+  pa_cvolume ChannelVolumes() const { return volume(); }
+  pa_channel_map ChannelMap() const { return channel_map(); }
+
+  // The card a sink or source belongs to, the monitor source of a sink, and
+  // the sink or source a stream is connected to. PA_INVALID_INDEX where
+  // there's none.
+  uint32_t CardIndex() const { return card_idx_; }
+  uint32_t MonitorIndex() const { return monitor_idx_; }
+  uint32_t OwnerIndex() const { return owner_idx_; }
 
  private:
   friend class PulseClient;
 
+  void pack(const char* name, const char* desc, const pa_proplist* proplist,
+            const pa_cvolume& volume, const pa_channel_map& channels);
+
+  pa_cvolume volume() const;
+  pa_channel_map channel_map() const;
   void update_volume(const pa_cvolume& newvol);
 
+  // A device as saved in a snapshot: its fixed-size fields, followed by
+  // its packed block.
+  struct Record;
+  Device(const Record& record, const char* packed);
+  void save(std::string* out) const;
+
   DeviceType type_;
   uint32_t index_;
-  std::string name_;
-  std::string desc_;
-  pa_cvolume volume_;
+  const Operations* ops_;
+
+  // The channel volumes and positions come first, then the name,
+  // description and properties.
+  Packed packed_;
+  uint8_t channels_ = 0;
+  uint32_t name_at_ = 0;
+  uint32_t desc_at_ = 0;
+  uint32_t props_at_ = 0;
+
   int volume_percent_;
-  pa_channel_map channels_;
   int mute_;
   int balance_;
   uint32_t card_idx_;
-  Operations ops_;
+
+  // The monitor source of a sink, and the sink or source a stream is
+  // connected to.
+  uint32_t monitor_idx_ = PA_INVALID_INDEX;
+  uint32_t owner_idx_ = PA_INVALID_INDEX;
+
   Device::Availability available_ = Availability::UNKNOWN;
 };
 
+// A card's strings, its profiles' included, share one allocation.
 class Card {
  public:
   Card(const pa_card_info* info);
 
-  const std::string& Name() const { return name_; }
+  // The card's profiles, in the order the server listed them.
+  class ProfileList {
+   public:
+    class iterator {
+     public:
+      explicit iterator(StringList::iterator iter) : iter_(iter) {}
+
+      Profile operator*() const {
+        StringList::iterator desc = iter_;
+        return Profile{ *iter_, *++desc };
+      }
+      iterator& operator++() {
+        ++iter_;
+        ++iter_;
+        return *this;
+      }
+      bool operator!=(const iterator& other) const { return iter_ != other.iter_; }
+
+     private:
+      StringList::iterator iter_;
+    };
+
+    explicit ProfileList(StringList strings) : strings_(strings) {}
+
+    iterator begin() const { return iterator(strings_.begin()); }
+    iterator end() const { return iterator(strings_.end()); }
+
+   private:
+    StringList strings_;
+  };
+
+  const char* Name() const { return packed_.At(name_at_); }
   uint32_t Index() const { return index_; }
-  const std::string& Driver() const { return driver_; }
+  const char* Desc() const { return packed_.At(desc_at_); }
+  StringList Props() const {
+    return StringList(packed_.At(props_at_), packed_.At(profiles_at_));
+  }
+  const char* Driver() const { return packed_.At(driver_at_); }
+  uint32_t OwnerModule() const { return owner_module_; }
 
-  const std::vector<Profile>& Profiles() const { return profiles_; }
-  const Profile& ActiveProfile() const { return active_profile_; }
+  ProfileList Profiles() const {
+    return ProfileList(
+        StringList(packed_.At(profiles_at_), packed_.At(packed_.Size())));
+  }
+  Profile ActiveProfile() const;
 
  private:
   friend class PulseClient;
 
   uint32_t index_;
-  std::string name_;
   uint32_t owner_module_;
-  std::string driver_;
-  std::vector<Profile> profiles_;
-  Profile active_profile_;
+
+  // The name, description, driver, properties, then each profile's name
+  // and description.
+  Packed packed_;
+  uint32_t name_at_ = 0;
+  uint32_t desc_at_ = 0;
+  uint32_t driver_at_ = 0;
+  uint32_t props_at_ = 0;
+  uint32_t profiles_at_ = 0;
+
+  // The offset of the active profile's name, if there is one.
+  uint32_t active_at_ = 0;
+  bool has_active_ = false;
 };
 
 struct ServerInfo {
@@ -110,7 +291,11 @@ struct ServerInfo {
   std::string source;
   std::string empty = "";
 
-  const std::string& GetDefault(DeviceType type) {
+  // Differs between runs of the server. Indices from one run mean nothing
+  // to another.
+  uint32_t cookie = 0;
+
+  const std::string& GetDefault(DeviceType type) const {
     switch (type) {
     case DeviceType::SINK:
       return sink;
@@ -140,46 +325,300 @@ struct Range {
   T max;
 };
 
+// Finds items whose names, descriptions or selected properties contain a
+// substring. Only texts sharing the rarest trigram of the substring are
+// checked. A match on a name beats one on a description, which beats one
+// on a property.
+class SubstringIndex {
+ public:
+  enum Field {
+    NAME,
+    DESC,
+    PROP,
+    FIELD_COUNT,
+  };
+
+  void Add(size_t slot, Field field, const std::string& text);
+  void Clear();
+
+  // The slots of the items matching in the first field with any match,
+  // in ascending order.
+  std::vector<size_t> Find(const std::string& needle) const;
+
+ private:
+  struct Text {
+    size_t slot;
+    std::string text;
+  };
+
+  struct Tier {
+    std::vector<Text> texts;
+    std::unordered_map<uint32_t, std::vector<size_t>> trigrams;
+  };
+
+  Tier tiers_[FIELD_COUNT];
+};
+
+// Devices or cards in the order the server listed them, indexed by index
+// and by name. Lookups take constant time. Removal takes linear time, but
+// is rare. Items are never moved, so a pointer to one stays valid until
+// that item is removed, either on its own or by a refresh it's missing from.
+template<typename T>
+class Collection {
+ public:
+  typedef typename std::list<T>::iterator iterator;
+
+  const std::list<T>& Items() const { return items_; }
+  iterator begin() { return items_.begin(); }
+  iterator end() { return items_.end(); }
+
+  // Get an item by index, or the first item with a name.
+  T* Get(const uint32_t index) {
+    auto iter = by_index_.find(index);
+    return iter != by_index_.end() ? &*iter->second : nullptr;
+  }
+
+  T* Get(const std::string& name) {
+    auto iter = by_name_.find(name);
+    return iter != by_name_.end() ? &*iter->second : nullptr;
+  }
+
+  // Add an item, replacing any item with the same index in place.
+  T& Put(T item) {
+    indexed_ = false;
+    if (refreshing_) refreshed_.insert(item.Index());
+
+    auto iter = by_index_.find(item.Index());
+    if (iter != by_index_.end()) {
+      T& slot = *iter->second;
+      const bool renamed = strcmp(slot.Name(), item.Name()) != 0;
+      slot = std::move(item);
+      if (renamed) reindex();
+      return slot;
+    }
+
+    items_.push_back(std::move(item));
+    const iterator slot = std::prev(items_.end());
+    by_index_.emplace(slot->Index(), slot);
+    by_name_.emplace(slot->Name(), slot);
+    return *slot;
+  }
+
+  void Remove(const uint32_t index) {
+    auto iter = by_index_.find(index);
+    if (iter == by_index_.end()) return;
+
+    indexed_ = false;
+    items_.erase(iter->second);
+    reindex();
+  }
+
+  void Clear() {
+    items_.clear();
+    by_index_.clear();
+    by_name_.clear();
+    indexed_ = false;
+  }
+
+  // Bracket a fetch of every item. Items put in between replace those
+  // already held in place; those not put are taken to be gone and removed
+  // at the end.
+  void BeginRefresh() {
+    refreshing_ = true;
+    refreshed_.clear();
+  }
+
+  void EndRefresh() {
+    refreshing_ = false;
+    const size_t size = items_.size();
+    items_.remove_if([this](const T& item) {
+      return refreshed_.count(item.Index()) == 0;
+    });
+    refreshed_.clear();
+    if (items_.size() != size) {
+      indexed_ = false;
+      reindex();
+    }
+  }
+
+  // Find the items containing a substring, as per SubstringIndex, in
+  // ascending order of index.
+  std::vector<T*> Find(const std::string& needle) {
+    BuildIndex();
+
+    std::vector<T*> found;
+    for (size_t slot : substrings_.Find(needle)) found.push_back(slots_[slot]);
+    std::sort(found.begin(), found.end(), [](const T* a, const T* b) {
+      return a->Index() < b->Index();
+    });
+    return found;
+  }
+
+  // The substring index is built on first use after any change, but can be
+  // built ahead of time, e.g. before forking.
+  void BuildIndex() {
+    if (indexed_) return;
+
+    substrings_.Clear();
+    slots_.clear();
+    for (T& item : items_) {
+      const size_t slot = slots_.size();
+      slots_.push_back(&item);
+      substrings_.Add(slot, SubstringIndex::NAME, item.Name());
+      substrings_.Add(slot, SubstringIndex::DESC, item.Desc());
+      for (const char* prop : item.Props()) {
+        if (*prop != '\0') substrings_.Add(slot, SubstringIndex::PROP, prop);
+      }
+    }
+    indexed_ = true;
+  }
+
+ private:
+  void reindex() {
+    by_index_.clear();
+    by_name_.clear();
+    for (iterator slot = items_.begin(); slot != items_.end(); ++slot) {
+      by_index_.emplace(slot->Index(), slot);
+      by_name_.emplace(slot->Name(), slot);
+    }
+  }
+
+  std::list<T> items_;
+  std::unordered_map<uint32_t, iterator> by_index_;
+  std::unordered_map<std::string, iterator> by_name_;
+
+  // The indices put since BeginRefresh, while a refresh is under way.
+  std::unordered_set<uint32_t> refreshed_;
+  bool refreshing_ = false;
+
+  // The items by the slot numbers the substring index knows them by.
+  std::vector<T*> slots_;
+  SubstringIndex substrings_;
+  bool indexed_ = false;
+};
+
 class PulseClient {
  public:
+  // The connection to the server is made on first use.
   PulseClient(std::string client_name);
   ~PulseClient();
 
+  // Forget the server connection without closing it, for use in a forked
+  // child which shares it with its parent. Anything already fetched is
+  // kept, and a new connection is made on next use.
+  void DropConnection();
+
+  // Keep every fetched device, card and the server info current by
+  // applying change events from the server as the mainloop runs.
+  void Subscribe();
+
+  // Once subscribed, call back whenever the known state has changed.
+  // Events arriving within window_ms of the first are gathered up, so that
+  // each changed device is fetched once and all of them reported together.
+  void SetChangeCallback(std::function<void()> callback, int window_ms);
+
+  // Run the mainloop until something asks it to quit, returning the
+  // value passed to quit. Sources of events can be added via the API.
+  int Run();
+  pa_mainloop_api* MainloopApi();
+
   // Populates all known devices and cards. Any currently known
   // devices and cards are cleared before the new data is stored.
+  // Calling this is optional: the getters below fetch whatever they
+  // need from the server on first use.
   void Populate();
 
-  // Get a device by index or name and type, or all devices by type.
+  // Populates whatever devices, cards and server info haven't been
+  // fetched yet, keeping anything already known.
+  void PopulateMissing();
+
+  // Populates all devices, but not cards or server info.
+  void PopulateDevices();
+
+  // Build the indices behind fuzzy lookups of whatever is known, which
+  // otherwise happens on first use after each change.
+  void BuildSearchIndex();
+
+  // Save every device and the server info, all of which must have been
+  // fetched, for another process running this same build to load.
+  std::string SaveSnapshot();
+
+  // Take devices and server info from a snapshot rather than the server.
+  // Anything else is still fetched on first use. Returns false, keeping
+  // nothing, if the snapshot is malformed.
+  bool LoadSnapshot(const std::string& snapshot);
+
+  // Save a sink or source as it is now, for ChangeRemembered to start from
+  // in another process.
+  std::string RememberDevice(const Device& device);
+
+  enum class ChangeResult {
+    CHANGED,
+    FAILED,
+    STALE,
+  };
+
+  // Apply a change to a sink or source saved by RememberDevice, without
+  // first asking the server for it. The change is sent by name, so it can
+  // only land on the device going by selector, which must be the name it
+  // was remembered by. The device is asked for in the same round trip, and
+  // if it has changed since it was remembered, the change is worked out
+  // again from how the device was just before and sent in place of the
+  // first, as if the device had been looked up first. On success, memo is
+  // updated to the device as changed. If no device goes by selector, STALE
+  // is returned, and the device should be looked up as usual. STALE is
+  // also returned, with nothing sent, if the device is already known here
+  // or memo can't be used.
+  ChangeResult ChangeRemembered(std::string* memo, const std::string& selector,
+                                const std::function<bool(Device&)>& change);
+
+  // Get a device by index or name and type, or all devices by type. A
+  // device given by index, or a sink or source given by its exact name, is
+  // looked up on its own rather than by fetching every device of its type.
+  // Returned pointers stay valid until the device is gone: fetching every
+  // device of its type again updates those still there in place.
   Device* GetDevice(const uint32_t index, DeviceType type);
   Device* GetDevice(const std::string& name, DeviceType type);
-  const std::vector<Device>& GetDevices(DeviceType type) const;
+  const std::list<Device>& GetDevices(DeviceType type);
+
+  // Ask the server for a device's current state, updating it in place.
+  // Returns null, having forgotten the device, if it has since gone.
+  Device* RefreshDevice(const Device& device);
+
+  // Get the devices of a type whose name, description or one of the
+  // properties fuzzy lookups go by matches glob, if given, and which have
+  // each property in props, given as KEY=VALUE where VALUE is a glob. Only
+  // a few properties are kept, so matching on them fetches every device of
+  // the type afresh.
+  std::vector<Device*> SelectDevices(DeviceType type, const char* glob,
+                                     const std::vector<const char*>& props);
 
   // Get a sink by index or name, or all sinks.
   Device* GetSink(const uint32_t index);
   Device* GetSink(const std::string& name);
-  const std::vector<Device>& GetSinks() const { return sinks_; }
+  const std::list<Device>& GetSinks();
 
   // Get a source by index or name, or all sources.
   Device* GetSource(const uint32_t index);
   Device* GetSource(const std::string& name);
-  const std::vector<Device>& GetSources() const { return sources_; }
+  const std::list<Device>& GetSources();
 
   // Get a sink input by index or name, or all sink inputs.
   Device* GetSinkInput(const uint32_t name);
   Device* GetSinkInput(const std::string& name);
-  const std::vector<Device>& GetSinkInputs() const { return sink_inputs_; }
+  const std::list<Device>& GetSinkInputs();
 
   // Get a source output by index or name, or all source outputs.
   Device* GetSourceOutput(const uint32_t name);
   Device* GetSourceOutput(const std::string& name);
-  const std::vector<Device>& GetSourceOutputs() const { return source_outputs_; }
+  const std::list<Device>& GetSourceOutputs();
 
   // Get a card by index or name, all cards, or get the card which
   // a sink is attached to.
   Card* GetCard(const uint32_t index);
   Card* GetCard(const std::string& name);
   Card* GetCard(const Device& device);
-  const std::vector<Card>& GetCards() const { return cards_; }
+  const std::list<Card>& GetCards();
 
   // Get or set the volume of a device.
   int GetVolume(const Device& device) const;
@@ -189,6 +628,10 @@ class PulseClient {
   bool IncreaseVolume(Device& device, long increment);
   bool DecreaseVolume(Device& device, long decrement);
 
+  // Move the volume of a device to a value in steps spread over duration
+  // milliseconds, returning once the final volume has been applied.
+  bool FadeVolume(Device& device, long value, long duration, FadeCurve curve);
+
   // Get or set the volume of a device. Not all devices support this.
   int GetBalance(const Device& device) const;
   bool SetBalance(Device& device, long value);
@@ -211,13 +654,25 @@ class PulseClient {
   // Move a given source output or sink input to the destination.
   bool Move(Device& source, Device& dest);
 
+  // Move every sink input or source output not already on a sink or
+  // source onto it, all at once, waiting for them even in async mode.
+  // Streams which fail to move are reported one by one. Returns whether
+  // all of them moved.
+  bool MoveStreams(Device& dest);
+
   // Kill a source output or sink input.
   bool Kill(Device& device);
 
   // Get or set the default sink and source.
-  const ServerInfo& GetDefaults() const { return defaults_; }
+  const ServerInfo& GetDefaults();
   bool SetDefault(Device& device);
 
+  // Record the peak level of what a device plays or captures, calling back
+  // with each peak, where 1.0 is full scale, rate times per second as the
+  // mainloop runs. A stream is metered on its own, and a source output by
+  // way of its source.
+  bool MonitorPeaks(Device& device, int rate, std::function<void(float)> callback);
+
   // Set minimum and maximum allowed volume
   void SetVolumeRange(int min, int max) {
     volume_range_ = { min, max };
@@ -228,35 +683,185 @@ class PulseClient {
     balance_range_ = { min, max };
   }
 
-  void SetNotifier(std::unique_ptr<Notifier> notifier);
+  void SetNotifier(std::shared_ptr<Notifier> notifier);
+
+  // In async mode, changes to devices are sent without waiting for the
+  // server to apply them, and the setters only report whether a change
+  // could be sent. The device is updated and the notifier fired once the
+  // server reports success. Getting a device first waits for any changes
+  // to it which are still outstanding.
+  void SetAsync(bool async) { async_ = async; }
+
+  // Wait for all outstanding changes, returning whether all of them
+  // succeeded since the last flush.
+  bool Flush();
 
  private:
+  // A change sent to the server on behalf of a device, applied to what we
+  // know of the device once the server reports success.
+  struct Operation {
+    PulseClient* client;
+    DeviceType type;
+    uint32_t index;
+    std::function<void(Device&)> apply;
+    bool sets_default = false;
+    pa_operation* op = nullptr;
+    int success = 0;
+
+    // A quiet operation's failure is left to whoever sent it to report.
+    bool quiet = false;
+    int error = 0;
+  };
+
+  // A fade in progress. Only one step is in flight at a time.
+  struct Fade {
+    PulseClient* client;
+    DeviceType type;
+    uint32_t index;
+    pa_volume_t from;
+    pa_volume_t to;
+    FadeCurve curve;
+    pa_usec_t start;
+    pa_usec_t duration;
+    Operation* step = nullptr;
+    bool last = false;
+    bool done = false;
+    bool success = false;
+  };
+
+  static void fade_timer_cb(pa_mainloop_api* api,
+                            pa_time_event* event,
+                            const struct timeval* tv,
+                            void* raw);
+
+  static void peak_read_cb(pa_stream* stream, size_t length, void* raw);
+  static void peak_state_cb(pa_stream* stream, void* raw);
+
+  static void operation_cb(pa_context* context, int success, void* raw);
+  Operation* new_operation(const Device& device,
+                           std::function<void(Device&)> apply);
+
+  // Track an operation, waiting for it unless in async mode.
+  bool submit(Operation* operation, pa_operation* op);
+
+  // Wait for each outstanding operation matching the predicate.
+  template<class Predicate> void wait_operations(Predicate pred);
+
+  // Wait for outstanding changes to a device, returning it again since
+  // the wait may have removed it.
+  Device* settle(Device* device);
+
+  pa_context* context();
+  void connect();
+
+  static void subscribe_cb(pa_context* context,
+                           pa_subscription_event_type_t type,
+                           uint32_t index,
+                           void* raw);
+  void handle_event(pa_subscription_event_type_t type, uint32_t index);
+  pa_operation* apply_event(pa_subscription_event_type_t type, uint32_t index);
+
+  static void change_timer_cb(pa_mainloop_api* api,
+                              pa_time_event* event,
+                              const struct timeval* tv,
+                              void* raw);
+  static void refresh_state_cb(pa_operation* op, void* raw);
+  void apply_queued_events();
+  pa_operation* refresh_device(DeviceType type, const uint32_t index,
+                               bool removed);
+
   void WaitOperationComplete(pa_operation* op);
+  void WaitOperationComplete(const std::vector<pa_operation*>& ops);
+
+  template<class T> T* find_fuzzy(Collection<T>& haystack, const std::string& needle);
+
+  // Bits tracking which collections have been fetched from the server.
+  enum PopulateMask : unsigned {
+    POPULATE_SERVER_INFO    = 1 << 0,
+    POPULATE_SINKS          = 1 << 1,
+    POPULATE_SOURCES        = 1 << 2,
+    POPULATE_SINK_INPUTS    = 1 << 3,
+    POPULATE_SOURCE_OUTPUTS = 1 << 4,
+    POPULATE_CARDS          = 1 << 5,
+    POPULATE_ALL            = (1 << 6) - 1,
+  };
+
+  // Fetch each collection in the mask which hasn't been fetched yet.
+  void ensure_populated(unsigned mask);
+
+  // Wait for ops, fetching every item of the collections in the mask, then
+  // mark those fetched and apply the events which arrived meanwhile.
+  void finish_populate(unsigned mask, const std::vector<pa_operation*>& ops);
+
+  // Each of these clears a collection and sends the request to refill it,
+  // returning without waiting for the reply.
+  pa_operation* populate_server_info();
+  pa_operation* populate_cards();
+  pa_operation* populate_sinks();
+  pa_operation* populate_sink_inputs();
+  pa_operation* populate_sources();
+  pa_operation* populate_source_outputs();
+
+  Device* get_device(Collection<Device>& devices, const std::string& name);
+
+  // Find a device among those already known, falling back to asking the
+  // server for it.
+  Device* lookup_device(DeviceType type, const uint32_t index);
+  Device* lookup_device(DeviceType type, const std::string& name);
+
+  // Ask the server for a single device by name, or by index if name is null.
+  Device* fetch_device(DeviceType type, const uint32_t index, const char* name);
+
+  // Send the request behind fetch_device, adding the device to found once
+  // the reply arrives.
+  pa_operation* query_device(DeviceType type, const uint32_t index,
+                             const char* name, std::vector<Device>* found);
 
-  template<class T> T* find_fuzzy(std::vector<T>& haystack, const std::string& needle);
+  // Send a device's change of mute or volume, by name if by_name_ is set.
+  pa_operation* send_mute(const Device& device, bool mute, Operation* operation);
+  pa_operation* send_volume(const Device& device, const pa_cvolume* cvol,
+                            Operation* operation);
 
-  void populate_server_info();
-  void populate_cards();
-  void populate_sinks();
-  void populate_sources();
+  // Ask the server for a single device by index, and update or add it to
+  // the known devices once the reply arrives.
+  pa_operation* fetch_device_async(DeviceType type, const uint32_t index);
 
-  Device* get_device(std::vector<Device>& devices, const uint32_t index);
-  Device* get_device(std::vector<Device>& devices, const std::string& name);
+  Collection<Device>& device_list(DeviceType type);
+  static unsigned populate_mask(DeviceType type);
+  static unsigned facility_mask(unsigned facility);
 
   void remove_device(Device& device);
+  void remove_device(DeviceType type, const uint32_t index);
 
   std::string client_name_;
-  pa_context* context_;
-  pa_mainloop* mainloop_;
-  std::vector<Device> sinks_;
-  std::vector<Device> sources_;
-  std::vector<Device> sink_inputs_;
-  std::vector<Device> source_outputs_;
-  std::vector<Card> cards_;
+  pa_context* context_ = nullptr;
+  pa_mainloop* mainloop_ = nullptr;
+  Collection<Device> sinks_;
+  Collection<Device> sources_;
+  Collection<Device> sink_inputs_;
+  Collection<Device> source_outputs_;
+  Collection<Card> cards_;
   ServerInfo defaults_;
+  unsigned populated_ = 0;
+  unsigned fetching_ = 0;
+  std::vector<std::pair<pa_subscription_event_type_t, uint32_t>> deferred_events_;
+  std::function<void()> change_callback_;
+  pa_usec_t change_window_ = 0;
+  pa_time_event* change_timer_ = nullptr;
+  std::map<std::pair<unsigned, uint32_t>, pa_subscription_event_type_t> queued_events_;
+  unsigned refreshing_ = 0;
+  pa_stream* peak_stream_ = nullptr;
+  std::function<void(float)> peak_callback_;
   Range<int> volume_range_;
   Range<int> balance_range_;
-  std::unique_ptr<Notifier> notifier_;
+  std::shared_ptr<Notifier> notifier_;
+  bool async_ = false;
+
+  // Whether changes to sink and source volume and mute address the device
+  // by name rather than index. See ChangeRemembered.
+  bool by_name_ = false;
+  bool failed_ = false;
+  std::vector<Operation*> pending_;
 };
 
 class unreachable : public std::runtime_error {
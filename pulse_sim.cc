@@ -0,0 +1,1135 @@
+// Self
+#include "pulse_sim.h"
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// C++
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// The simulated server stands in for contexts, operations, introspection
+// and streams. The mainloop, proplists and volume arithmetic are still
+// those of the real libpulse. Each request is answered on the mainloop,
+// in order, once the configured latency has passed.
+
+struct pa_context {
+  pa_mainloop_api* api;
+  pa_time_event* timer;
+  std::deque<std::pair<pa_usec_t, std::function<void()>>> replies;
+  pa_context_state_t state;
+  pa_context_notify_cb_t state_cb;
+  void* state_userdata;
+  pa_context_subscribe_cb_t subscribe_cb;
+  void* subscribe_userdata;
+  pa_subscription_mask_t subscriptions;
+  int error;
+
+  // How many round trips deep the replies seen so far go. See SimStats.
+  unsigned long depth;
+};
+
+struct pa_operation {
+  unsigned refs;
+  pa_operation_state_t state;
+  pa_operation_notify_cb_t state_cb;
+  void* state_userdata;
+};
+
+struct pa_stream {
+  pa_context* context;
+  pa_stream_state_t state;
+  pa_stream_notify_cb_t state_cb;
+  void* state_userdata;
+};
+
+namespace {
+
+struct SimDevice {
+  uint32_t index;
+  std::string name;
+  std::string desc;
+  pa_cvolume volume;
+  bool mute;
+  uint32_t card;
+  // The sink or source a stream is connected to, or the sink a monitor
+  // source belongs to.
+  uint32_t owner;
+  // The monitor source of a sink.
+  uint32_t monitor;
+  std::shared_ptr<pa_proplist> props;
+};
+
+struct SimCard {
+  uint32_t index;
+  std::string name;
+  std::vector<std::string> profiles;
+  size_t active;
+  std::shared_ptr<pa_proplist> props;
+};
+
+// The devices of one type, by index and by name.
+class Facility {
+ public:
+  SimDevice* Get(uint32_t index) {
+    auto iter = devices_.find(index);
+    return iter == devices_.end() ? nullptr : &iter->second;
+  }
+
+  SimDevice* Get(const std::string& name) {
+    auto iter = by_name_.find(name);
+    return iter == by_name_.end() ? nullptr : Get(iter->second);
+  }
+
+  void Add(SimDevice device) {
+    by_name_[device.name] = device.index;
+    devices_[device.index] = std::move(device);
+  }
+
+  void Remove(uint32_t index) {
+    auto iter = devices_.find(index);
+    if (iter == devices_.end()) return;
+
+    auto name = by_name_.find(iter->second.name);
+    if (name != by_name_.end() && name->second == index) by_name_.erase(name);
+    devices_.erase(iter);
+  }
+
+  std::map<uint32_t, SimDevice>& Devices() { return devices_; }
+
+ private:
+  std::map<uint32_t, SimDevice> devices_;
+  std::unordered_map<std::string, uint32_t> by_name_;
+};
+
+struct Server {
+  Facility sinks;
+  Facility sources;
+  Facility sink_inputs;
+  Facility source_outputs;
+  std::map<uint32_t, SimCard> cards;
+  std::string default_sink;
+  std::string default_source;
+  pa_usec_t latency = 0;
+};
+
+Server* server = nullptr;
+SimStats stats;
+
+const char* const kApplications[] = {
+  "mpv", "firefox", "spotify", "mumble", "chromium", "vlc", "mplayer", "steam",
+};
+const size_t kApplicationCount = sizeof(kApplications) / sizeof(*kApplications);
+
+// Real titles aren't plain ASCII: those of every other stream carry quotes,
+// an accent and a tab, which anything printing them has to cope with.
+std::string media_name(const char* kind, unsigned i) {
+  std::string name = kind + (" " + std::to_string(i));
+  if (i % 2) name += " \"Caf\xc3\xa9\"\t";
+  return name;
+}
+
+std::shared_ptr<pa_proplist> make_props(
+    std::initializer_list<std::pair<const char*, std::string>> props) {
+  std::shared_ptr<pa_proplist> proplist(pa_proplist_new(), pa_proplist_free);
+  for (const auto& prop : props) {
+    pa_proplist_sets(proplist.get(), prop.first, prop.second.c_str());
+  }
+  return proplist;
+}
+
+const pa_channel_map& stereo() {
+  static pa_channel_map map;
+  pa_channel_map_init_stereo(&map);
+  return map;
+}
+
+pa_sample_spec sample_spec() {
+  pa_sample_spec spec;
+  spec.format = PA_SAMPLE_S16LE;
+  spec.rate = 44100;
+  spec.channels = 2;
+  return spec;
+}
+
+SimDevice make_device(uint32_t index, std::string name, std::string desc,
+                      uint32_t card, uint32_t owner,
+                      std::shared_ptr<pa_proplist> props) {
+  SimDevice device;
+  device.index = index;
+  device.name = std::move(name);
+  device.desc = std::move(desc);
+  pa_cvolume_set(&device.volume, 2, PA_VOLUME_NORM / 2);
+  device.mute = false;
+  device.card = card;
+  device.owner = owner;
+  device.monitor = PA_INVALID_INDEX;
+  device.props = std::move(props);
+  return device;
+}
+
+// Changes are saved as lines of "facility index mute owner channels
+// volume...", "card index profile" and "default-sink name" or
+// "default-source name". Streams which aren't listed were killed.
+Facility Server::* const kFacilities[] = {
+  &Server::sinks, &Server::sources, &Server::sink_inputs, &Server::source_outputs,
+};
+const char* const kFacilityNames[] = {
+  "sink", "source", "sink-input", "source-output",
+};
+
+void save_state() {
+  const char* path = getenv("PONYMIX_SIM_STATE");
+  if (path == nullptr) return;
+
+  FILE* fp = fopen(path, "w");
+  if (fp == nullptr) return;
+
+  for (size_t i = 0; i < 4; i++) {
+    for (auto& entry : (server->*kFacilities[i]).Devices()) {
+      const SimDevice& device = entry.second;
+      fprintf(fp, "%s %u %d %u %u", kFacilityNames[i], device.index,
+              device.mute, device.owner, device.volume.channels);
+      for (unsigned c = 0; c < device.volume.channels; c++) {
+        fprintf(fp, " %u", device.volume.values[c]);
+      }
+      fputc('\n', fp);
+    }
+  }
+  for (auto& entry : server->cards) {
+    fprintf(fp, "card %u %zu\n", entry.first, entry.second.active);
+  }
+  if (!server->default_sink.empty()) {
+    fprintf(fp, "default-sink %s\n", server->default_sink.c_str());
+  }
+  if (!server->default_source.empty()) {
+    fprintf(fp, "default-source %s\n", server->default_source.c_str());
+  }
+
+  fclose(fp);
+}
+
+void load_state() {
+  const char* path = getenv("PONYMIX_SIM_STATE");
+  if (path == nullptr) return;
+
+  FILE* fp = fopen(path, "r");
+  if (fp == nullptr) return;
+
+  std::set<uint32_t> listed[4];
+  bool any = false;
+  char tag[32], name[256];
+  while (fscanf(fp, "%31s", tag) == 1) {
+    if (strcmp(tag, "default-sink") == 0 || strcmp(tag, "default-source") == 0) {
+      if (fscanf(fp, " %255[^\n]", name) != 1) break;
+      if (strcmp(tag, "default-sink") == 0) {
+        server->default_sink = name;
+      } else {
+        server->default_source = name;
+      }
+      continue;
+    }
+
+    if (strcmp(tag, "card") == 0) {
+      uint32_t index;
+      size_t active;
+      if (fscanf(fp, "%u %zu", &index, &active) != 2) break;
+      auto card = server->cards.find(index);
+      if (card != server->cards.end() && active < card->second.profiles.size()) {
+        card->second.active = active;
+      }
+      continue;
+    }
+
+    size_t i = 0;
+    while (i < 4 && strcmp(tag, kFacilityNames[i]) != 0) i++;
+    uint32_t index, owner;
+    unsigned mute, channels;
+    if (i == 4 || fscanf(fp, "%u %u %u %u", &index, &mute, &owner, &channels) != 4 ||
+        channels > PA_CHANNELS_MAX) {
+      break;
+    }
+
+    pa_cvolume volume;
+    volume.channels = channels;
+    for (unsigned c = 0; c < channels; c++) {
+      if (fscanf(fp, "%u", &volume.values[c]) != 1) channels = 0;
+    }
+
+    SimDevice* device = (server->*kFacilities[i]).Get(index);
+    if (device == nullptr) continue;
+
+    device->mute = mute;
+    device->owner = owner;
+    if (channels > 0) device->volume = volume;
+    listed[i].insert(index);
+    any = true;
+  }
+  fclose(fp);
+
+  if (!any) return;
+
+  for (size_t i = 2; i < 4; i++) {
+    std::vector<uint32_t> killed;
+    for (auto& entry : (server->*kFacilities[i]).Devices()) {
+      if (listed[i].count(entry.first) == 0) killed.push_back(entry.first);
+    }
+    for (uint32_t index : killed) (server->*kFacilities[i]).Remove(index);
+  }
+}
+
+void populate(const SimConfig& config) {
+  delete server;
+  server = new Server;
+  stats = SimStats();
+  server->latency = config.latency;
+
+  for (unsigned i = 0; i < config.cards; i++) {
+    const std::string n = std::to_string(i);
+    server->cards[i] = SimCard{
+      i, "sim_card." + n,
+      { "output:analog-stereo+input:analog-stereo", "output:analog-stereo", "off" },
+      0,
+      make_props({ { PA_PROP_DEVICE_DESCRIPTION, "Simulated Card " + n } }),
+    };
+  }
+
+  auto card_of = [&config](unsigned i) {
+    return config.cards ? i % config.cards : PA_INVALID_INDEX;
+  };
+
+  for (unsigned i = 0; i < config.sinks; i++) {
+    const std::string n = std::to_string(i);
+    SimDevice sink = make_device(
+        i, "sim_output." + n, "Simulated Output " + n, card_of(i), PA_INVALID_INDEX,
+        make_props({ { PA_PROP_DEVICE_DESCRIPTION, "Simulated Output " + n },
+                     { PA_PROP_DEVICE_PRODUCT_NAME, "Simulated Audio " + n } }));
+    sink.monitor = i;
+    server->sources.Add(make_device(
+        i, sink.name + ".monitor", "Monitor of Simulated Output " + n, card_of(i), i,
+        make_props({ { PA_PROP_DEVICE_DESCRIPTION, "Monitor of Simulated Output " + n } })));
+    server->sinks.Add(std::move(sink));
+  }
+
+  for (unsigned i = 0; i < config.sources; i++) {
+    const std::string n = std::to_string(i);
+    server->sources.Add(make_device(
+        config.sinks + i, "sim_input." + n, "Simulated Input " + n, card_of(i),
+        PA_INVALID_INDEX,
+        make_props({ { PA_PROP_DEVICE_DESCRIPTION, "Simulated Input " + n },
+                     { PA_PROP_DEVICE_PRODUCT_NAME, "Simulated Audio " + n } })));
+  }
+
+  for (unsigned i = 0; i < config.sink_inputs; i++) {
+    const std::string app = kApplications[i % kApplicationCount];
+    server->sink_inputs.Add(make_device(
+        i, "playback", "", PA_INVALID_INDEX,
+        config.sinks ? i % config.sinks : PA_INVALID_INDEX,
+        make_props({ { PA_PROP_APPLICATION_NAME, app },
+                     { PA_PROP_APPLICATION_PROCESS_BINARY, app },
+                     { PA_PROP_MEDIA_NAME, media_name("Track", i) } })));
+  }
+
+  for (unsigned i = 0; i < config.source_outputs; i++) {
+    const std::string app = kApplications[(i + 3) % kApplicationCount];
+    uint32_t source = PA_INVALID_INDEX;
+    if (config.sources) {
+      source = config.sinks + i % config.sources;
+    } else if (config.sinks) {
+      source = i % config.sinks;
+    }
+    server->source_outputs.Add(make_device(
+        i, "record", "", PA_INVALID_INDEX, source,
+        make_props({ { PA_PROP_APPLICATION_NAME, app },
+                     { PA_PROP_APPLICATION_PROCESS_BINARY, app },
+                     { PA_PROP_MEDIA_NAME, media_name("Recording", i) } })));
+  }
+
+  if (config.sinks) server->default_sink = "sim_output.0";
+  if (config.sources) {
+    server->default_source = "sim_input.0";
+  } else if (config.sinks) {
+    server->default_source = "sim_output.0.monitor";
+  }
+
+  load_state();
+}
+
+Server& sim() {
+  if (server != nullptr) return *server;
+
+  SimConfig config;
+  const char* spec = getenv("PONYMIX_SIM");
+  std::string pairs = spec ? spec : "";
+  size_t pos = 0;
+  while (pos < pairs.size()) {
+    size_t end = pairs.find(',', pos);
+    if (end == std::string::npos) end = pairs.size();
+    const std::string pair = pairs.substr(pos, end - pos);
+    pos = end + 1;
+
+    const size_t eq = pair.find('=');
+    if (eq == std::string::npos) continue;
+    const std::string key = pair.substr(0, eq);
+    const unsigned long value = strtoul(pair.c_str() + eq + 1, nullptr, 10);
+    if (key == "sinks") {
+      config.sinks = value;
+    } else if (key == "sources") {
+      config.sources = value;
+    } else if (key == "sink-inputs") {
+      config.sink_inputs = value;
+    } else if (key == "source-outputs") {
+      config.source_outputs = value;
+    } else if (key == "cards") {
+      config.cards = value;
+    } else if (key == "latency") {
+      config.latency = value;
+    } else {
+      fprintf(stderr, "pulse_sim: ignoring unknown setting: %s\n", key.c_str());
+    }
+  }
+
+  populate(config);
+  return *server;
+}
+
+SimDevice* lookup(Facility& facility, uint32_t index) {
+  return facility.Get(index);
+}
+
+// Names may also be one of the aliases the server understands for its
+// defaults.
+SimDevice* lookup(Facility& facility, const std::string& name) {
+  if (name == "@DEFAULT_SINK@") return facility.Get(sim().default_sink);
+  if (name == "@DEFAULT_SOURCE@") return facility.Get(sim().default_source);
+  if (name == "@DEFAULT_MONITOR@") {
+    SimDevice* sink = sim().sinks.Get(sim().default_sink);
+    return sink ? facility.Get(sink->monitor) : nullptr;
+  }
+  return facility.Get(name);
+}
+
+void arm(pa_context* c) {
+  if (c->replies.empty()) {
+    c->api->time_restart(c->timer, nullptr);
+  } else {
+    struct timeval tv;
+    c->api->time_restart(
+        c->timer, pa_timeval_rtstore(&tv, c->replies.front().first, true));
+  }
+}
+
+void reply_cb(pa_mainloop_api*, pa_time_event*, const struct timeval*, void* raw) {
+  auto c = static_cast<pa_context*>(raw);
+
+  // Anything queued by these replies waits for the next iteration.
+  const pa_usec_t now = pa_rtclock_now();
+  while (!c->replies.empty() && c->replies.front().first <= now) {
+    std::function<void()> reply = std::move(c->replies.front().second);
+    c->replies.pop_front();
+    reply();
+  }
+  arm(c);
+}
+
+void reply(pa_context* c, std::function<void()> fn) {
+  c->replies.emplace_back(pa_rtclock_now() + sim().latency, std::move(fn));
+  if (c->replies.size() == 1) arm(c);
+}
+
+void set_context_state(pa_context* c, pa_context_state_t state) {
+  c->state = state;
+  if (c->state_cb) c->state_cb(c, c->state_userdata);
+}
+
+void set_operation_state(pa_operation* o, pa_operation_state_t state) {
+  if (o->state != PA_OPERATION_RUNNING) return;
+  o->state = state;
+  if (o->state_cb) o->state_cb(o, o->state_userdata);
+}
+
+// Run fn as the server's answer to a request.
+pa_operation* request(pa_context* c, std::function<void()> fn) {
+  // Whatever the client sends now, it sends having seen every reply so
+  // far, and no others.
+  const unsigned long depth = c->depth + 1;
+  stats.requests++;
+  stats.round_trips = std::max(stats.round_trips, depth);
+
+  auto o = new pa_operation{ 2, PA_OPERATION_RUNNING, nullptr, nullptr };
+  reply(c, [c, o, fn, depth]() {
+    c->depth = std::max(c->depth, depth);
+    if (o->state == PA_OPERATION_RUNNING) {
+      fn();
+      set_operation_state(o, PA_OPERATION_DONE);
+    }
+    pa_operation_unref(o);
+  });
+  return o;
+}
+
+void event(pa_context* c, pa_subscription_event_type_t facility,
+           pa_subscription_event_type_t type, uint32_t index) {
+  if (c->subscribe_cb == nullptr || !(c->subscriptions & (1 << facility))) return;
+
+  reply(c, [c, facility, type, index]() {
+    if (c->subscribe_cb) {
+      c->subscribe_cb(c, static_cast<pa_subscription_event_type_t>(facility | type),
+                      index, c->subscribe_userdata);
+    }
+  });
+}
+
+// Apply a change, answering with whether it succeeded.
+pa_operation* change(pa_context* c, std::function<bool()> apply,
+                     pa_context_success_cb_t cb, void* userdata) {
+  return request(c, [c, apply, cb, userdata]() {
+    const bool success = apply();
+    if (success) {
+      save_state();
+    } else {
+      c->error = PA_ERR_NOENTITY;
+    }
+    if (cb) cb(c, success, userdata);
+  });
+}
+
+// Devices are changed by index, or by name as a std::string.
+template<typename Key>
+pa_operation* set_volume(pa_context* c, Facility Server::* facility,
+                         pa_subscription_event_type_t type, Key key,
+                         const pa_cvolume* volume, pa_context_success_cb_t cb,
+                         void* userdata) {
+  const pa_cvolume cvol = *volume;
+  return change(c, [c, facility, type, key, cvol]() {
+    SimDevice* device = lookup(sim().*facility, key);
+    if (device == nullptr) return false;
+    device->volume = cvol;
+    event(c, type, PA_SUBSCRIPTION_EVENT_CHANGE, device->index);
+    return true;
+  }, cb, userdata);
+}
+
+template<typename Key>
+pa_operation* set_mute(pa_context* c, Facility Server::* facility,
+                       pa_subscription_event_type_t type, Key key, int mute,
+                       pa_context_success_cb_t cb, void* userdata) {
+  return change(c, [c, facility, type, key, mute]() {
+    SimDevice* device = lookup(sim().*facility, key);
+    if (device == nullptr) return false;
+    device->mute = mute;
+    event(c, type, PA_SUBSCRIPTION_EVENT_CHANGE, device->index);
+    return true;
+  }, cb, userdata);
+}
+
+pa_operation* kill_stream(pa_context* c, Facility Server::* facility,
+                          pa_subscription_event_type_t type, uint32_t index,
+                          pa_context_success_cb_t cb, void* userdata) {
+  return change(c, [c, facility, type, index]() {
+    if ((sim().*facility).Get(index) == nullptr) return false;
+    (sim().*facility).Remove(index);
+    event(c, type, PA_SUBSCRIPTION_EVENT_REMOVE, index);
+    return true;
+  }, cb, userdata);
+}
+
+pa_operation* move_stream(pa_context* c, Facility Server::* facility,
+                          Facility Server::* targets,
+                          pa_subscription_event_type_t type, uint32_t index,
+                          uint32_t target, pa_context_success_cb_t cb,
+                          void* userdata) {
+  return change(c, [c, facility, targets, type, index, target]() {
+    SimDevice* device = (sim().*facility).Get(index);
+    if (device == nullptr || (sim().*targets).Get(target) == nullptr) return false;
+    device->owner = target;
+    event(c, type, PA_SUBSCRIPTION_EVENT_CHANGE, index);
+    return true;
+  }, cb, userdata);
+}
+
+pa_operation* set_default(pa_context* c, Facility Server::* facility,
+                          std::string Server::* current, const char* name,
+                          pa_context_success_cb_t cb, void* userdata) {
+  const std::string target = name ? name : "";
+  return change(c, [c, facility, current, target]() {
+    SimDevice* device = lookup(sim().*facility, target);
+    if (device == nullptr) return false;
+    sim().*current = device->name;
+    event(c, PA_SUBSCRIPTION_EVENT_SERVER, PA_SUBSCRIPTION_EVENT_CHANGE,
+          PA_INVALID_INDEX);
+    return true;
+  }, cb, userdata);
+}
+
+// Answer with a single device, or with a failure if there's no such
+// device.
+template<typename Info, typename Lookup>
+pa_operation* get_info(pa_context* c, Facility Server::* facility, Lookup key,
+                       void (*fill)(const SimDevice&, Info*),
+                       void (*cb)(pa_context*, const Info*, int, void*),
+                       void* userdata) {
+  return request(c, [c, facility, key, fill, cb, userdata]() {
+    SimDevice* device = lookup(sim().*facility, key);
+    if (device == nullptr) {
+      c->error = PA_ERR_NOENTITY;
+      if (cb) cb(c, nullptr, -1, userdata);
+      return;
+    }
+
+    Info info;
+    fill(*device, &info);
+    if (cb) {
+      cb(c, &info, 0, userdata);
+      cb(c, nullptr, 1, userdata);
+    }
+  });
+}
+
+// Answer with every device of a type.
+template<typename Info>
+pa_operation* get_info_list(pa_context* c, Facility Server::* facility,
+                            void (*fill)(const SimDevice&, Info*),
+                            void (*cb)(pa_context*, const Info*, int, void*),
+                            void* userdata) {
+  return request(c, [c, facility, fill, cb, userdata]() {
+    if (cb == nullptr) return;
+    for (auto& entry : (sim().*facility).Devices()) {
+      Info info;
+      fill(entry.second, &info);
+      cb(c, &info, 0, userdata);
+    }
+    cb(c, nullptr, 1, userdata);
+  });
+}
+
+// Newer versions of libpulse add fields to the port structs, so they're
+// zeroed and filled in by name rather than initialized in order.
+template<typename Port>
+Port port(const char* name, const char* description) {
+  Port port;
+  memset(&port, 0, sizeof(port));
+  port.name = name;
+  port.description = description;
+  port.priority = 100;
+  port.available = PA_PORT_AVAILABLE_YES;
+  return port;
+}
+
+pa_sink_port_info sink_port =
+    port<pa_sink_port_info>("analog-output", "Analog Output");
+
+pa_source_port_info source_port =
+    port<pa_source_port_info>("analog-input", "Analog Input");
+
+const char* device_name(Facility& facility, uint32_t index) {
+  SimDevice* device = facility.Get(index);
+  return device ? device->name.c_str() : nullptr;
+}
+
+void fill_sink(const SimDevice& device, pa_sink_info* info) {
+  memset(info, 0, sizeof(*info));
+  info->name = device.name.c_str();
+  info->index = device.index;
+  info->description = device.desc.c_str();
+  info->sample_spec = sample_spec();
+  info->channel_map = stereo();
+  info->owner_module = PA_INVALID_INDEX;
+  info->volume = device.volume;
+  info->mute = device.mute;
+  info->monitor_source = device.monitor;
+  info->monitor_source_name = device_name(sim().sources, device.monitor);
+  info->driver = "pulse_sim.cc";
+  info->proplist = device.props.get();
+  info->card = device.card;
+  info->active_port = &sink_port;
+}
+
+void fill_source(const SimDevice& device, pa_source_info* info) {
+  memset(info, 0, sizeof(*info));
+  info->name = device.name.c_str();
+  info->index = device.index;
+  info->description = device.desc.c_str();
+  info->sample_spec = sample_spec();
+  info->channel_map = stereo();
+  info->owner_module = PA_INVALID_INDEX;
+  info->volume = device.volume;
+  info->mute = device.mute;
+  info->monitor_of_sink = device.owner;
+  info->monitor_of_sink_name = device_name(sim().sinks, device.owner);
+  info->driver = "pulse_sim.cc";
+  info->proplist = device.props.get();
+  info->card = device.card;
+  info->active_port = &source_port;
+}
+
+void fill_sink_input(const SimDevice& device, pa_sink_input_info* info) {
+  memset(info, 0, sizeof(*info));
+  info->index = device.index;
+  info->name = device.name.c_str();
+  info->owner_module = PA_INVALID_INDEX;
+  info->client = PA_INVALID_INDEX;
+  info->sink = device.owner;
+  info->sample_spec = sample_spec();
+  info->channel_map = stereo();
+  info->volume = device.volume;
+  info->driver = "pulse_sim.cc";
+  info->mute = device.mute;
+  info->proplist = device.props.get();
+}
+
+void fill_source_output(const SimDevice& device, pa_source_output_info* info) {
+  memset(info, 0, sizeof(*info));
+  info->index = device.index;
+  info->name = device.name.c_str();
+  info->owner_module = PA_INVALID_INDEX;
+  info->client = PA_INVALID_INDEX;
+  info->source = device.owner;
+  info->sample_spec = sample_spec();
+  info->channel_map = stereo();
+  info->volume = device.volume;
+  info->driver = "pulse_sim.cc";
+  info->mute = device.mute;
+  info->proplist = device.props.get();
+}
+
+void reply_card(pa_context* c, const SimCard& card, pa_card_info_cb_t cb,
+                void* userdata) {
+  std::vector<pa_card_profile_info> profiles;
+  for (const std::string& profile : card.profiles) {
+    profiles.push_back({ profile.c_str(), profile.c_str(), 1, 1, 0 });
+  }
+  profiles.push_back({ nullptr, nullptr, 0, 0, 0 });
+
+  pa_card_info info;
+  memset(&info, 0, sizeof(info));
+  info.index = card.index;
+  info.name = card.name.c_str();
+  info.owner_module = PA_INVALID_INDEX;
+  info.driver = "pulse_sim.cc";
+  info.n_profiles = card.profiles.size();
+  info.profiles = profiles.data();
+  info.active_profile = &profiles[card.active];
+  info.proplist = card.props.get();
+  cb(c, &info, 0, userdata);
+}
+
+}  // namespace
+
+void SimConfigure(const SimConfig& config) {
+  populate(config);
+}
+
+SimStats SimGetStats() {
+  return stats;
+}
+
+pa_context* pa_context_new_with_proplist(pa_mainloop_api* api, const char*,
+                                         const pa_proplist*) {
+  auto c = new pa_context;
+  c->api = api;
+  c->timer = api->time_new(api, nullptr, reply_cb, c);
+  c->state = PA_CONTEXT_UNCONNECTED;
+  c->state_cb = nullptr;
+  c->state_userdata = nullptr;
+  c->subscribe_cb = nullptr;
+  c->subscribe_userdata = nullptr;
+  c->subscriptions = PA_SUBSCRIPTION_MASK_NULL;
+  c->error = PA_OK;
+  c->depth = 0;
+  return c;
+}
+
+void pa_context_unref(pa_context* c) {
+  c->api->time_free(c->timer);
+  delete c;
+}
+
+void pa_context_set_state_callback(pa_context* c, pa_context_notify_cb_t cb,
+                                   void* userdata) {
+  c->state_cb = cb;
+  c->state_userdata = userdata;
+}
+
+int pa_context_errno(const pa_context* c) {
+  return c->error;
+}
+
+pa_context_state_t pa_context_get_state(const pa_context* c) {
+  return c->state;
+}
+
+int pa_context_connect(pa_context* c, const char*, pa_context_flags_t,
+                       const pa_spawn_api*) {
+  if (c->state != PA_CONTEXT_UNCONNECTED) {
+    c->error = PA_ERR_BADSTATE;
+    return -1;
+  }
+
+  sim();
+  set_context_state(c, PA_CONTEXT_CONNECTING);
+  reply(c, [c]() { set_context_state(c, PA_CONTEXT_READY); });
+  return 0;
+}
+
+void pa_context_disconnect(pa_context* c) {
+  set_context_state(c, PA_CONTEXT_TERMINATED);
+}
+
+void pa_context_set_subscribe_callback(pa_context* c, pa_context_subscribe_cb_t cb,
+                                       void* userdata) {
+  c->subscribe_cb = cb;
+  c->subscribe_userdata = userdata;
+}
+
+pa_operation* pa_context_subscribe(pa_context* c, pa_subscription_mask_t mask,
+                                   pa_context_success_cb_t cb, void* userdata) {
+  return request(c, [c, mask, cb, userdata]() {
+    c->subscriptions = mask;
+    if (cb) cb(c, 1, userdata);
+  });
+}
+
+pa_operation* pa_context_get_server_info(pa_context* c, pa_server_info_cb_t cb,
+                                         void* userdata) {
+  return request(c, [c, cb, userdata]() {
+    pa_server_info info;
+    memset(&info, 0, sizeof(info));
+    info.user_name = "ponymix";
+    info.host_name = "localhost";
+    info.server_version = "pulse_sim";
+    info.server_name = "pulse_sim";
+    info.sample_spec = sample_spec();
+    info.default_sink_name = sim().default_sink.c_str();
+    info.default_source_name = sim().default_source.c_str();
+    info.channel_map = stereo();
+    if (cb) cb(c, &info, userdata);
+  });
+}
+
+pa_operation* pa_context_get_sink_info_by_name(pa_context* c, const char* name,
+                                               pa_sink_info_cb_t cb, void* userdata) {
+  return get_info(c, &Server::sinks, std::string(name), fill_sink, cb, userdata);
+}
+
+pa_operation* pa_context_get_sink_info_by_index(pa_context* c, uint32_t index,
+                                                pa_sink_info_cb_t cb, void* userdata) {
+  return get_info(c, &Server::sinks, index, fill_sink, cb, userdata);
+}
+
+pa_operation* pa_context_get_sink_info_list(pa_context* c, pa_sink_info_cb_t cb,
+                                            void* userdata) {
+  return get_info_list(c, &Server::sinks, fill_sink, cb, userdata);
+}
+
+pa_operation* pa_context_get_source_info_by_name(pa_context* c, const char* name,
+                                                 pa_source_info_cb_t cb,
+                                                 void* userdata) {
+  return get_info(c, &Server::sources, std::string(name), fill_source, cb, userdata);
+}
+
+pa_operation* pa_context_get_source_info_by_index(pa_context* c, uint32_t index,
+                                                  pa_source_info_cb_t cb,
+                                                  void* userdata) {
+  return get_info(c, &Server::sources, index, fill_source, cb, userdata);
+}
+
+pa_operation* pa_context_get_source_info_list(pa_context* c, pa_source_info_cb_t cb,
+                                              void* userdata) {
+  return get_info_list(c, &Server::sources, fill_source, cb, userdata);
+}
+
+pa_operation* pa_context_get_sink_input_info(pa_context* c, uint32_t index,
+                                             pa_sink_input_info_cb_t cb,
+                                             void* userdata) {
+  return get_info(c, &Server::sink_inputs, index, fill_sink_input, cb, userdata);
+}
+
+pa_operation* pa_context_get_sink_input_info_list(pa_context* c,
+                                                  pa_sink_input_info_cb_t cb,
+                                                  void* userdata) {
+  return get_info_list(c, &Server::sink_inputs, fill_sink_input, cb, userdata);
+}
+
+pa_operation* pa_context_get_source_output_info(pa_context* c, uint32_t index,
+                                                pa_source_output_info_cb_t cb,
+                                                void* userdata) {
+  return get_info(c, &Server::source_outputs, index, fill_source_output, cb,
+                  userdata);
+}
+
+pa_operation* pa_context_get_source_output_info_list(pa_context* c,
+                                                     pa_source_output_info_cb_t cb,
+                                                     void* userdata) {
+  return get_info_list(c, &Server::source_outputs, fill_source_output, cb,
+                       userdata);
+}
+
+pa_operation* pa_context_get_card_info_by_index(pa_context* c, uint32_t index,
+                                                pa_card_info_cb_t cb, void* userdata) {
+  return request(c, [c, index, cb, userdata]() {
+    auto card = sim().cards.find(index);
+    if (card == sim().cards.end()) {
+      c->error = PA_ERR_NOENTITY;
+      if (cb) cb(c, nullptr, -1, userdata);
+      return;
+    }
+
+    if (cb) {
+      reply_card(c, card->second, cb, userdata);
+      cb(c, nullptr, 1, userdata);
+    }
+  });
+}
+
+pa_operation* pa_context_get_card_info_list(pa_context* c, pa_card_info_cb_t cb,
+                                            void* userdata) {
+  return request(c, [c, cb, userdata]() {
+    if (cb == nullptr) return;
+    for (auto& card : sim().cards) reply_card(c, card.second, cb, userdata);
+    cb(c, nullptr, 1, userdata);
+  });
+}
+
+pa_operation* pa_context_set_card_profile_by_index(pa_context* c, uint32_t index,
+                                                   const char* profile,
+                                                   pa_context_success_cb_t cb,
+                                                   void* userdata) {
+  const std::string name = profile ? profile : "";
+  return change(c, [c, index, name]() {
+    auto card = sim().cards.find(index);
+    if (card == sim().cards.end()) return false;
+
+    const std::vector<std::string>& profiles = card->second.profiles;
+    for (size_t i = 0; i < profiles.size(); i++) {
+      if (profiles[i] == name) {
+        card->second.active = i;
+        event(c, PA_SUBSCRIPTION_EVENT_CARD, PA_SUBSCRIPTION_EVENT_CHANGE, index);
+        return true;
+      }
+    }
+    return false;
+  }, cb, userdata);
+}
+
+pa_operation* pa_context_set_sink_volume_by_index(pa_context* c, uint32_t index,
+                                                  const pa_cvolume* volume,
+                                                  pa_context_success_cb_t cb,
+                                                  void* userdata) {
+  return set_volume(c, &Server::sinks, PA_SUBSCRIPTION_EVENT_SINK, index, volume,
+                    cb, userdata);
+}
+
+pa_operation* pa_context_set_source_volume_by_index(pa_context* c, uint32_t index,
+                                                    const pa_cvolume* volume,
+                                                    pa_context_success_cb_t cb,
+                                                    void* userdata) {
+  return set_volume(c, &Server::sources, PA_SUBSCRIPTION_EVENT_SOURCE, index,
+                    volume, cb, userdata);
+}
+
+pa_operation* pa_context_set_sink_volume_by_name(pa_context* c, const char* name,
+                                                 const pa_cvolume* volume,
+                                                 pa_context_success_cb_t cb,
+                                                 void* userdata) {
+  return set_volume(c, &Server::sinks, PA_SUBSCRIPTION_EVENT_SINK,
+                    std::string(name), volume, cb, userdata);
+}
+
+pa_operation* pa_context_set_source_volume_by_name(pa_context* c, const char* name,
+                                                   const pa_cvolume* volume,
+                                                   pa_context_success_cb_t cb,
+                                                   void* userdata) {
+  return set_volume(c, &Server::sources, PA_SUBSCRIPTION_EVENT_SOURCE,
+                    std::string(name), volume, cb, userdata);
+}
+
+pa_operation* pa_context_set_sink_input_volume(pa_context* c, uint32_t index,
+                                               const pa_cvolume* volume,
+                                               pa_context_success_cb_t cb,
+                                               void* userdata) {
+  return set_volume(c, &Server::sink_inputs, PA_SUBSCRIPTION_EVENT_SINK_INPUT,
+                    index, volume, cb, userdata);
+}
+
+pa_operation* pa_context_set_source_output_volume(pa_context* c, uint32_t index,
+                                                  const pa_cvolume* volume,
+                                                  pa_context_success_cb_t cb,
+                                                  void* userdata) {
+  return set_volume(c, &Server::source_outputs, PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT,
+                    index, volume, cb, userdata);
+}
+
+pa_operation* pa_context_set_sink_mute_by_index(pa_context* c, uint32_t index,
+                                                int mute, pa_context_success_cb_t cb,
+                                                void* userdata) {
+  return set_mute(c, &Server::sinks, PA_SUBSCRIPTION_EVENT_SINK, index, mute, cb,
+                  userdata);
+}
+
+pa_operation* pa_context_set_source_mute_by_index(pa_context* c, uint32_t index,
+                                                  int mute,
+                                                  pa_context_success_cb_t cb,
+                                                  void* userdata) {
+  return set_mute(c, &Server::sources, PA_SUBSCRIPTION_EVENT_SOURCE, index, mute,
+                  cb, userdata);
+}
+
+pa_operation* pa_context_set_sink_mute_by_name(pa_context* c, const char* name,
+                                               int mute, pa_context_success_cb_t cb,
+                                               void* userdata) {
+  return set_mute(c, &Server::sinks, PA_SUBSCRIPTION_EVENT_SINK,
+                  std::string(name), mute, cb, userdata);
+}
+
+pa_operation* pa_context_set_source_mute_by_name(pa_context* c, const char* name,
+                                                 int mute,
+                                                 pa_context_success_cb_t cb,
+                                                 void* userdata) {
+  return set_mute(c, &Server::sources, PA_SUBSCRIPTION_EVENT_SOURCE,
+                  std::string(name), mute, cb, userdata);
+}
+
+pa_operation* pa_context_set_sink_input_mute(pa_context* c, uint32_t index,
+                                             int mute, pa_context_success_cb_t cb,
+                                             void* userdata) {
+  return set_mute(c, &Server::sink_inputs, PA_SUBSCRIPTION_EVENT_SINK_INPUT, index,
+                  mute, cb, userdata);
+}
+
+pa_operation* pa_context_set_source_output_mute(pa_context* c, uint32_t index,
+                                                int mute, pa_context_success_cb_t cb,
+                                                void* userdata) {
+  return set_mute(c, &Server::source_outputs, PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT,
+                  index, mute, cb, userdata);
+}
+
+pa_operation* pa_context_kill_sink_input(pa_context* c, uint32_t index,
+                                         pa_context_success_cb_t cb, void* userdata) {
+  return kill_stream(c, &Server::sink_inputs, PA_SUBSCRIPTION_EVENT_SINK_INPUT,
+                     index, cb, userdata);
+}
+
+pa_operation* pa_context_kill_source_output(pa_context* c, uint32_t index,
+                                            pa_context_success_cb_t cb,
+                                            void* userdata) {
+  return kill_stream(c, &Server::source_outputs, PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT,
+                     index, cb, userdata);
+}
+
+pa_operation* pa_context_move_sink_input_by_index(pa_context* c, uint32_t index,
+                                                  uint32_t sink,
+                                                  pa_context_success_cb_t cb,
+                                                  void* userdata) {
+  return move_stream(c, &Server::sink_inputs, &Server::sinks,
+                     PA_SUBSCRIPTION_EVENT_SINK_INPUT, index, sink, cb, userdata);
+}
+
+pa_operation* pa_context_move_source_output_by_index(pa_context* c, uint32_t index,
+                                                     uint32_t source,
+                                                     pa_context_success_cb_t cb,
+                                                     void* userdata) {
+  return move_stream(c, &Server::source_outputs, &Server::sources,
+                     PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT, index, source, cb,
+                     userdata);
+}
+
+pa_operation* pa_context_set_default_sink(pa_context* c, const char* name,
+                                          pa_context_success_cb_t cb,
+                                          void* userdata) {
+  return set_default(c, &Server::sinks, &Server::default_sink, name, cb, userdata);
+}
+
+pa_operation* pa_context_set_default_source(pa_context* c, const char* name,
+                                            pa_context_success_cb_t cb,
+                                            void* userdata) {
+  return set_default(c, &Server::sources, &Server::default_source, name, cb,
+                     userdata);
+}
+
+pa_operation* pa_operation_ref(pa_operation* o) {
+  o->refs++;
+  return o;
+}
+
+void pa_operation_unref(pa_operation* o) {
+  if (--o->refs == 0) delete o;
+}
+
+void pa_operation_cancel(pa_operation* o) {
+  set_operation_state(o, PA_OPERATION_CANCELLED);
+}
+
+pa_operation_state_t pa_operation_get_state(const pa_operation* o) {
+  return o->state;
+}
+
+void pa_operation_set_state_callback(pa_operation* o, pa_operation_notify_cb_t cb,
+                                     void* userdata) {
+  o->state_cb = cb;
+  o->state_userdata = userdata;
+}
+
+// There's no audio to record, so streams fail to connect.
+pa_stream* pa_stream_new(pa_context* c, const char*, const pa_sample_spec*,
+                         const pa_channel_map*) {
+  return new pa_stream{ c, PA_STREAM_UNCONNECTED, nullptr, nullptr };
+}
+
+void pa_stream_unref(pa_stream* s) {
+  delete s;
+}
+
+int pa_stream_set_monitor_stream(pa_stream*, uint32_t) {
+  return 0;
+}
+
+void pa_stream_set_read_callback(pa_stream*, pa_stream_request_cb_t, void*) {
+}
+
+void pa_stream_set_state_callback(pa_stream* s, pa_stream_notify_cb_t cb,
+                                  void* userdata) {
+  s->state_cb = cb;
+  s->state_userdata = userdata;
+}
+
+pa_stream_state_t pa_stream_get_state(const pa_stream* s) {
+  return s->state;
+}
+
+pa_context* pa_stream_get_context(const pa_stream* s) {
+  return s->context;
+}
+
+int pa_stream_connect_record(pa_stream* s, const char*, const pa_buffer_attr*,
+                             pa_stream_flags_t) {
+  s->state = PA_STREAM_CREATING;
+  reply(s->context, [s]() {
+    s->context->error = PA_ERR_NOTSUPPORTED;
+    s->state = PA_STREAM_FAILED;
+    if (s->state_cb) s->state_cb(s, s->state_userdata);
+  });
+  return 0;
+}
+
+int pa_stream_peek(pa_stream*, const void** data, size_t* nbytes) {
+  *data = nullptr;
+  *nbytes = 0;
+  return 0;
+}
+
+int pa_stream_drop(pa_stream*) {
+  return 0;
+}
+
+// vim: set et ts=2 sw=2:
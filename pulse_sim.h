@@ -0,0 +1,41 @@
+#pragma once
+
+// external
+#include <pulse/pulseaudio.h>
+
+// A simulated PulseAudio server for tests and benchmarks, linked in place
+// of the parts of libpulse which talk to a real one. Its devices and cards
+// are made up according to a SimConfig. Each process has a server of its
+// own, so nothing done in one process is seen by another as it happens.
+struct SimConfig {
+  unsigned sinks = 2;
+  unsigned sources = 1;
+  unsigned sink_inputs = 2;
+  unsigned source_outputs = 1;
+  unsigned cards = 1;
+
+  // How long the server takes to answer each request, in microseconds.
+  pa_usec_t latency = 0;
+};
+
+// Replace the simulated server's devices and cards with a fresh set. Until
+// this is called, they're made up from $PONYMIX_SIM, a comma separated list
+// of key=value pairs overriding the defaults above, e.g.
+// "sinks=100,sink-inputs=1000,latency=200". If $PONYMIX_SIM_STATE names a
+// file, changes are saved there and picked up by later processes.
+void SimConfigure(const SimConfig& config);
+
+// What's been asked of the simulated server since it was last configured.
+struct SimStats {
+  // Requests made, not counting connecting.
+  unsigned long requests = 0;
+
+  // The longest chain of requests each made only after the reply to the
+  // one before it had come back: how many times a real server's latency is
+  // waited out. Requests sent together, pipelined, count once.
+  unsigned long round_trips = 0;
+};
+
+SimStats SimGetStats();
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,31 @@
+// Self
+#include "runtime.h"
+
+// C
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// C++
+#include <functional>
+
+std::string RuntimePath(const char* name) {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir == nullptr || *runtime_dir == '\0') return "";
+
+  return std::string(runtime_dir) + "/" + name;
+}
+
+std::string RuntimePath(const std::string& key, const char* suffix) {
+  char name[64];
+  snprintf(name, sizeof(name), "ponymix-%zx.%s",
+           std::hash<std::string>()(key), suffix);
+  return RuntimePath(name);
+}
+
+bool ProcessAlive(pid_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,23 @@
+#pragma once
+
+// C
+#include <sys/types.h>
+
+// C++
+#include <string>
+
+// The files through which invocations share state live in the runtime
+// directory, $XDG_RUNTIME_DIR. Without one, there's nowhere to share state.
+
+// The path of a file in the runtime directory, or an empty string if there
+// is no runtime directory.
+std::string RuntimePath(const char* name);
+
+// The path of a file of the kind given by suffix, one per key, named after
+// the key's hash.
+std::string RuntimePath(const std::string& key, const char* suffix);
+
+// Whether a process exists, whether or not it's ours to signal.
+bool ProcessAlive(pid_t pid);
+
+// vim: set et ts=2 sw=2:
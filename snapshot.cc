@@ -0,0 +1,291 @@
+// Self
+#include "snapshot.h"
+
+#include "runtime.h"
+
+// C
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// C++
+#include <algorithm>
+
+struct SnapshotHeader {
+  uint32_t magic;
+
+  // What PulseClient saves is only meant to be loaded by the same build.
+  char build[64];
+
+  // Odd while an update is under way.
+  uint32_t sequence;
+
+  // Set once the file has been replaced by a bigger one.
+  uint32_t retired;
+
+  // The size of the snapshot following the header.
+  uint32_t size;
+
+  // Raised by invocations about to change something the snapshot holds.
+  // Readers don't trust the snapshot until its sequence reaches awaited,
+  // or until the monotonic clock, in milliseconds, passes await_deadline.
+  uint32_t awaited;
+  uint64_t await_deadline;
+};
+
+namespace {
+
+const uint32_t kMagic = 0x706f6e79;
+const size_t kMinCapacity = 64 * 1024;
+
+// How many times a reader retries while updates are under way before
+// giving up on the snapshot.
+const int kReadAttempts = 100;
+
+// How long readers wait for a change to show up in the snapshot. A change
+// which turns out to change nothing is never published.
+const uint64_t kAwaitMsec = 1000;
+
+enum class ReadResult {
+  OK,
+  RETIRED,
+  BEHIND,
+  FAILED,
+};
+
+uint64_t now_msec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+template<typename T>
+void store_max(T* target, T value) {
+  T current = __atomic_load_n(target, __ATOMIC_SEQ_CST);
+  while (current < value &&
+         !__atomic_compare_exchange_n(target, &current, value, false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {}
+}
+
+// Whether the header was written by this build, and so laid out as ours.
+bool ours(const SnapshotHeader* header) {
+  return header->magic == kMagic &&
+         strncmp(header->build, PONYMIX_VERSION, sizeof(header->build)) == 0;
+}
+
+// Whether the daemon which published to the file is still running. It
+// holds an exclusive lock on the file for as long as it publishes there,
+// which, unlike its pid, can't be inherited by an unrelated process.
+bool writer_alive(int fd) {
+  if (flock(fd, LOCK_SH | LOCK_NB) < 0) return errno == EWOULDBLOCK;
+  flock(fd, LOCK_UN);
+  return false;
+}
+
+void write_snapshot(SnapshotHeader* header, const std::string& snapshot) {
+  const uint32_t sequence = header->sequence;
+  __atomic_store_n(&header->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(header + 1, snapshot.data(), snapshot.size());
+  __atomic_store_n(&header->size, snapshot.size(), __ATOMIC_RELAXED);
+
+  __atomic_store_n(&header->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+ReadResult read_snapshot(const SnapshotHeader* header, size_t length,
+                         std::string* snapshot) {
+  if (!ours(header)) return ReadResult::FAILED;
+
+  for (int attempt = 0; attempt < kReadAttempts; attempt++) {
+    if (__atomic_load_n(&header->retired, __ATOMIC_ACQUIRE)) {
+      return ReadResult::RETIRED;
+    }
+
+    const uint32_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1) {
+      sched_yield();
+      continue;
+    }
+
+    // A torn size can only come with a changed sequence, but must not
+    // take the copy out of bounds in the meantime.
+    const uint32_t size = __atomic_load_n(&header->size, __ATOMIC_RELAXED);
+    if (size > length - sizeof(*header)) continue;
+    snapshot->assign(reinterpret_cast<const char*>(header + 1), size);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) != sequence) {
+      continue;
+    }
+
+    if (sequence == 0) return ReadResult::FAILED;
+    if (sequence < __atomic_load_n(&header->awaited, __ATOMIC_SEQ_CST) &&
+        now_msec() < __atomic_load_n(&header->await_deadline, __ATOMIC_SEQ_CST)) {
+      return ReadResult::BEHIND;
+    }
+    return ReadResult::OK;
+  }
+
+  return ReadResult::FAILED;
+}
+
+}  // namespace
+
+std::string SnapshotPath() {
+  return RuntimePath("ponymix.snapshot");
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  if (header_ == nullptr) return;
+
+  unlink(SnapshotPath().c_str());
+  __atomic_store_n(&header_->retired, 1, __ATOMIC_RELEASE);
+  munmap(header_, mapped_);
+  close(fd_);
+}
+
+bool SnapshotWriter::Publish(const std::string& snapshot) {
+  const size_t needed = sizeof(SnapshotHeader) + snapshot.size();
+  if (header_ != nullptr && needed <= mapped_) {
+    write_snapshot(header_, snapshot);
+    return true;
+  }
+
+  // Readers may still have the old file mapped, so fill in a bigger one
+  // and swap it in, then tell them to look again.
+  const std::string path = SnapshotPath();
+  if (path.empty()) return false;
+
+  const std::string temp = path + ".new";
+  const size_t length = sizeof(SnapshotHeader) +
+      std::max(kMinCapacity, 2 * snapshot.size());
+  int fd = open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) return false;
+
+  // The lock is held, and the file kept open, for as long as we publish
+  // to it.
+  void* map = MAP_FAILED;
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0 && ftruncate(fd, length) == 0) {
+    map = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (map == MAP_FAILED) {
+    close(fd);
+    unlink(temp.c_str());
+    return false;
+  }
+
+  auto header = static_cast<SnapshotHeader*>(map);
+  header->magic = kMagic;
+  strncpy(header->build, PONYMIX_VERSION, sizeof(header->build));
+  if (header_ != nullptr) header->sequence = header_->sequence;
+  write_snapshot(header, snapshot);
+
+  // Updates awaited on the old file carry over to the new one. Those
+  // raised after it's retired are raised again on the new one, so retire
+  // it before copying them.
+  if (header_ != nullptr) {
+    __atomic_store_n(&header_->retired, 1, __ATOMIC_SEQ_CST);
+    store_max(&header->awaited,
+              __atomic_load_n(&header_->awaited, __ATOMIC_SEQ_CST));
+    store_max(&header->await_deadline,
+              __atomic_load_n(&header_->await_deadline, __ATOMIC_SEQ_CST));
+  }
+
+  if (rename(temp.c_str(), path.c_str()) < 0) {
+    if (header_ != nullptr) __atomic_store_n(&header_->retired, 0, __ATOMIC_SEQ_CST);
+    munmap(map, length);
+    close(fd);
+    unlink(temp.c_str());
+    return false;
+  }
+
+  if (header_ != nullptr) {
+    munmap(header_, mapped_);
+    close(fd_);
+  }
+  header_ = header;
+  mapped_ = length;
+  fd_ = fd;
+  return true;
+}
+
+SnapshotStatus ReadSnapshot(std::string* snapshot) {
+  const std::string path = SnapshotPath();
+  if (path.empty()) return SnapshotStatus::UNAVAILABLE;
+
+  // Each retired file means a newer one has taken its place.
+  for (int attempt = 0; attempt < kReadAttempts; attempt++) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return SnapshotStatus::UNAVAILABLE;
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (writer_alive(fd) && fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(SnapshotHeader)) {
+      map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return SnapshotStatus::UNAVAILABLE;
+
+    ReadResult result = read_snapshot(static_cast<const SnapshotHeader*>(map),
+                                      st.st_size, snapshot);
+    munmap(map, st.st_size);
+
+    switch (result) {
+    case ReadResult::OK:
+      return SnapshotStatus::OK;
+    case ReadResult::BEHIND:
+      return SnapshotStatus::BEHIND;
+    case ReadResult::FAILED:
+      return SnapshotStatus::UNAVAILABLE;
+    case ReadResult::RETIRED:
+      break;
+    }
+  }
+
+  return SnapshotStatus::UNAVAILABLE;
+}
+
+void AwaitSnapshotUpdate() {
+  const std::string path = SnapshotPath();
+  if (path.empty()) return;
+
+  for (int attempt = 0; attempt < kReadAttempts; attempt++) {
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(SnapshotHeader)) {
+      map = mmap(nullptr, sizeof(SnapshotHeader), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    // Whatever update is under way may have started before our change,
+    // so it's the one after that which counts.
+    auto header = static_cast<SnapshotHeader*>(map);
+    bool retired = false;
+    if (ours(header)) {
+      const uint32_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_SEQ_CST);
+      store_max(&header->awaited, (sequence + 3) & ~1u);
+      store_max(&header->await_deadline, now_msec() + kAwaitMsec);
+      retired = __atomic_load_n(&header->retired, __ATOMIC_SEQ_CST);
+    }
+    munmap(map, sizeof(SnapshotHeader));
+
+    if (!retired) return;
+  }
+}
+
+// vim: set et ts=2 sw=2:
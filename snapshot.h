@@ -0,0 +1,63 @@
+#pragma once
+
+// C
+#include <stddef.h>
+#include <stdint.h>
+
+// C++
+#include <string>
+
+// A snapshot of the devices and server info kept current by the daemon,
+// published in a file under $XDG_RUNTIME_DIR which readers map, so that
+// queries can be answered without talking to the daemon or the server.
+// Updates are protected by a sequence lock: readers retry rather than
+// block if one is under way.
+// The daemon also holds a lock on the file for as long as it runs, so that
+// a snapshot left behind by one which died isn't mistaken for current.
+
+// Where the snapshot lives, or an empty string if there's no runtime
+// directory to put it in.
+std::string SnapshotPath();
+
+struct SnapshotHeader;
+
+class SnapshotWriter {
+ public:
+  SnapshotWriter() {}
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+  // Replace the published snapshot, moving to a bigger file if it no
+  // longer fits. Returns false if it couldn't be published.
+  bool Publish(const std::string& snapshot);
+
+ private:
+  SnapshotHeader* header_ = nullptr;
+  size_t mapped_ = 0;
+  int fd_ = -1;
+};
+
+enum class SnapshotStatus {
+  OK,
+
+  // The snapshot has yet to catch up with a change announced by
+  // AwaitSnapshotUpdate. The daemon knows no more than it has published,
+  // so ask the server instead.
+  BEHIND,
+
+  // There's no snapshot from a live daemon, or a consistent copy couldn't
+  // be had.
+  UNAVAILABLE,
+};
+
+// Read the snapshot published by a live daemon.
+SnapshotStatus ReadSnapshot(std::string* snapshot);
+
+// Announce a change about to be made to what the snapshot holds. Readers
+// won't use the snapshot until the daemon publishes one from after the
+// change, or a second passes.
+void AwaitSnapshotUpdate();
+
+// vim: set et ts=2 sw=2:
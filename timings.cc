@@ -0,0 +1,141 @@
+// Self
+#include "timings.h"
+
+#include "json.h"
+
+// C
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+// Enough for any one command line. A daemon run with timings enabled stops
+// recording rather than growing without bound.
+const size_t kMaxEntries = 4096;
+const size_t kMaxMarks = 1 << 20;
+
+// Quote s as a JSON string.
+std::string json_string(const std::string& s) {
+  std::string quoted;
+  AppendJsonString(s.c_str(), &quoted);
+  return quoted;
+}
+
+}  // namespace
+
+bool Timings::enabled_ = false;
+bool Timings::summary_ = false;
+FILE* Timings::trace_ = nullptr;
+uint64_t Timings::start_ = 0;
+int Timings::depth_ = 0;
+std::vector<Timings::Entry> Timings::entries_;
+std::vector<Timings::Mark> Timings::marks_;
+std::map<std::string, long> Timings::counters_;
+
+void Timings::Enable() {
+  summary_ = true;
+  start();
+}
+
+bool Timings::Trace(const char* path) {
+  if (trace_ != nullptr) return true;
+
+  trace_ = fopen(path, "we");
+  if (trace_ == nullptr) return false;
+
+  start();
+  return true;
+}
+
+void Timings::start() {
+  if (enabled_) return;
+
+  enabled_ = true;
+  start_ = now();
+  atexit(finish);
+}
+
+uint64_t Timings::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+size_t Timings::begin(const char* name) {
+  if (entries_.size() >= kMaxEntries) return kNone;
+
+  entries_.push_back(Entry{ name, depth_++, now(), 0 });
+  return entries_.size() - 1;
+}
+
+void Timings::end(size_t entry) {
+  entries_[entry].end = now();
+  depth_--;
+}
+
+void Timings::describe(size_t entry, const std::string& detail) {
+  entries_[entry].name += " " + detail;
+}
+
+void Timings::mark(const char* name, char type, long value) {
+  if (marks_.size() >= kMaxMarks) return;
+
+  marks_.push_back(Mark{ name, type, now(), value });
+}
+
+void Timings::finish() {
+  if (summary_) report();
+  if (trace_ != nullptr) write_trace();
+}
+
+void Timings::report() {
+  const uint64_t end = now();
+
+  fputs("timings:\n", stderr);
+  for (const Entry& entry : entries_) {
+    // Anything still going is cut short by the exit.
+    const uint64_t duration = (entry.end ? entry.end : end) - entry.start;
+    fprintf(stderr, "  %10.3f ms  %*s%s\n", duration / 1e6, 2 * entry.depth, "",
+            entry.name.c_str());
+  }
+  fprintf(stderr, "  %10.3f ms  total\n", (end - start_) / 1e6);
+}
+
+void Timings::write_trace() {
+  const uint64_t end = now();
+  const int pid = getpid();
+
+  // Times are in microseconds since recording started. Everything happens
+  // on the main thread, so phases nest as they should on a single track.
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", trace_);
+  fprintf(trace_, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+          "\"args\":{\"name\":\"ponymix\"}}", pid, pid);
+
+  for (const Entry& entry : entries_) {
+    const uint64_t finished = entry.end ? entry.end : end;
+    fprintf(trace_, ",\n{\"name\":%s,\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%d}",
+            json_string(entry.name).c_str(), (entry.start - start_) / 1e3,
+            (finished - entry.start) / 1e3, pid, pid);
+  }
+
+  for (const Mark& mark : marks_) {
+    const double ts = (mark.time - start_) / 1e3;
+    if (mark.type == 'i') {
+      fprintf(trace_, ",\n{\"name\":%s,\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+              "\"pid\":%d,\"tid\":%d,\"args\":{\"index\":%ld}}",
+              json_string(mark.name).c_str(), ts, pid, pid, mark.value);
+    } else {
+      fprintf(trace_, ",\n{\"name\":%s,\"ph\":\"C\",\"ts\":%.3f,"
+              "\"pid\":%d,\"args\":{\"value\":%ld}}",
+              json_string(mark.name).c_str(), ts, pid, mark.value);
+    }
+  }
+
+  fputs("\n]}\n", trace_);
+  if (fclose(trace_) != 0) perror("failed to write trace");
+  trace_ = nullptr;
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,105 @@
+#pragma once
+
+// C
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// C++
+#include <map>
+#include <string>
+#include <vector>
+
+// Where a run of ponymix spends its time, for --timings and --trace.
+// Nothing is recorded until Enable() or Trace() is called, and until then a
+// Phase, Instant or Count costs no more than a test of a flag.
+class Timings {
+ public:
+  // Start recording, and print a summary of the phases to stderr at exit.
+  static void Enable();
+
+  // Start recording, and write everything recorded to path as a Chrome
+  // trace, for chrome://tracing or Perfetto, at exit. Only the first call
+  // opens a file.
+  static bool Trace(const char* path);
+
+  static bool enabled() { return enabled_; }
+  static bool tracing() { return trace_ != nullptr; }
+
+  // Mark a moment in the trace, e.g. the reply for a device arriving.
+  static void Instant(const char* name, uint32_t index) {
+    if (tracing()) mark(name, 'i', index);
+  }
+
+  // Count another of something, e.g. a mainloop iteration, as a counter
+  // track in the trace.
+  static void Count(const char* name) {
+    if (tracing()) mark(name, 'C', ++counters_[name]);
+  }
+
+ private:
+  friend class Phase;
+
+  struct Entry {
+    std::string name;
+    int depth;
+    uint64_t start;
+    uint64_t end;
+  };
+
+  // An instant event or a counter's new value.
+  struct Mark {
+    const char* name;
+    char type;
+    uint64_t time;
+    long value;
+  };
+
+  static const size_t kNone = static_cast<size_t>(-1);
+
+  static uint64_t now();
+  static void start();
+  static size_t begin(const char* name);
+  static void end(size_t entry);
+  static void describe(size_t entry, const std::string& detail);
+  static void mark(const char* name, char type, long value);
+  static void finish();
+  static void report();
+  static void write_trace();
+
+  static bool enabled_;
+  static bool summary_;
+  static FILE* trace_;
+  static uint64_t start_;
+  static int depth_;
+  static std::vector<Entry> entries_;
+  static std::vector<Mark> marks_;
+  static std::map<std::string, long> counters_;
+};
+
+// Records the time from its construction to its destruction as a phase of
+// the given name. Phases begun while it's alive are shown nested under it.
+class Phase {
+ public:
+  explicit Phase(const char* name) {
+    if (Timings::enabled()) entry_ = Timings::begin(name);
+  }
+
+  ~Phase() {
+    if (entry_ != Timings::kNone) Timings::end(entry_);
+  }
+
+  Phase(const Phase&) = delete;
+  Phase& operator=(const Phase&) = delete;
+
+  // Add what the phase is working on to its name. If working out detail
+  // costs anything, check Timings::enabled() first.
+  void Describe(const std::string& detail) {
+    if (entry_ != Timings::kNone) Timings::describe(entry_, detail);
+  }
+
+ private:
+  size_t entry_ = Timings::kNone;
+};
+
+// vim: set et ts=2 sw=2: